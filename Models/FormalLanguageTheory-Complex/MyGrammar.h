@@ -27,7 +27,7 @@ public:
 			S b = vms->getpop<S>();
 			S& a = vms->stack<S>().topref();
 			
-			if(a.length() + b.length() > max_length) throw VMSRuntimeError();
+			if(a.length() + b.length() > max_length) vms->status = vmstatus_t::ERROR; // stops the VirtualMachineState
 			else 									 a += b; 
 		}));
 		
@@ -35,7 +35,7 @@ public:
 			char b = vms->getpop<char>();
 			S& a = vms->stack<S>().topref();
 			
-			if(a.length() + 1 > max_length) throw VMSRuntimeError();
+			if(a.length() + 1 > max_length) vms->status = vmstatus_t::ERROR;
 			else 							a += b; 
 		}));
 
@@ -45,12 +45,12 @@ public:
 		add("(%s==%s)", +[](S x, S y) -> bool { return x==y; });
 		add("empty(%s)", +[](S x) -> bool { 	return x.length()==0; });
 		
-		add("insert(%s,%s)", +[](S x, S y) -> S { 
+		add("insert(%s,%s)", +[](S x, S y) -> std::optional<S> { 
 			size_t l = x.length();
 			if(l == 0) 
 				return y;
 			else if(l + y.length() > max_length) 
-				throw VMSRuntimeError();
+				return std::nullopt; // an error
 			else {
 				// put y into the middle of x
 				size_t pos = l/2;
@@ -76,10 +76,10 @@ public:
 			StrSet s; s.insert(x); return s; 
 		}, CONSTANT_P);
 		
-		add("(%s\u222A%s)", +[](StrSet s, StrSet x) -> StrSet { 
+		add("(%s\u222A%s)", +[](StrSet s, StrSet x) -> std::optional<StrSet> { 
 			for(auto& xi : x) {
 				s.insert(xi);
-				if(s.size() > max_setsize) throw VMSRuntimeError();
+				if(s.size() > max_setsize) return std::nullopt;
 			}
 			return s;
 		});
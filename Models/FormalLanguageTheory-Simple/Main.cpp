@@ -30,8 +30,8 @@ public:
 		add("tail(%s)",      +[](S s)      -> S { return (s.empty() ? S("") : s.substr(1,S::npos)); });
 		add("head(%s)",      +[](S s)      -> S { return (s.empty() ? S("") : S(1,s.at(0))); });
 //
-//		add("append(%s,%s)",   +[](S a, S b) -> S { 
-//			if(a.length() + b.length() > MAX_LENGTH) throw VMSRuntimeError();
+//		add("append(%s,%s)",   +[](S a, S b) -> std::optional<S> { 
+//			if(a.length() + b.length() > MAX_LENGTH) return std::nullopt; // an error
 //			else                     				 return a+b; 
 //		});
 
@@ -39,7 +39,7 @@ public:
 			S b = vms->getpop<S>();
 			S& a = vms->stack<S>().topref();
 			
-			if(a.length() + b.length() > MAX_LENGTH) throw VMSRuntimeError();
+			if(a.length() + b.length() > MAX_LENGTH) vms->status = vmstatus_t::ERROR; // stops the VirtualMachineState
 			else 									 a += b; 
 		}));
 		
@@ -47,7 +47,7 @@ public:
 			char b = vms->getpop<char>();
 			S& a = vms->stack<S>().topref();
 			
-			if(a.length() + 1 > MAX_LENGTH) throw VMSRuntimeError();
+			if(a.length() + 1 > MAX_LENGTH) vms->status = vmstatus_t::ERROR;
 			else 						    a += b; 
 		}));
 
@@ -181,6 +181,7 @@ int main(int argc, char** argv){
 					r->p = 0.0; // set to be zero to assure it's never sampled. 
 				}
 			}
+			grammar.probabilities_changed();
 			
 			auto h0 = MyHypothesis::sample({}); 
 			for(size_t i=0;i<nf;i++) {
@@ -340,7 +340,7 @@ int main(int argc, char** argv){
 	// Run 
 	//------------------
 	
-	grammar.GRAMMAR_MAX_DEPTH = MAX_GRAMMAR_DEPTH;
+	grammar.set_max_depth(MAX_GRAMMAR_DEPTH);
 	
 	// top stores the top hypotheses we have found
 	TopN<MyHypothesis> top;
@@ -217,12 +217,48 @@ int main(int argc, char** argv){
 		assert(n.string() == n2.string());		
 	}
 	COUT "GOOD" ENDL;
-	
-	
+
+	// Assigning into a subtree (with = or assign) and then changing something lower down must leave the cached
+	// count, hash, and log probability of the whole tree as they would be for the same tree freshly parsed
+	COUT "# Assigning into subtrees...";
+	for(size_t i=0;i<1000;i++) {
+		auto n = grammar.generate();
+		if(n.is_terminal()) continue;
+
+		// fill in the caches
+		n.count(); n.hash(); grammar.log_probability(n);
+
+		auto check = [&]() {
+			Node q = grammar.from_parseable(n.parseable());
+			assert(q == n);
+			assert(q.count() == n.count());
+			assert(q.hash() == n.hash());
+			assert(abs(grammar.log_probability(q)-grammar.log_probability(n)) < 1e-9);
+			for(auto& ni: n) {
+				ni.check_child_info();
+			}
+		};
+
+		auto& c = n.child(myrandom(n.nchildren()));
+		Node g = grammar.generate(c.nt());
+		if(flip()) c = g;
+		else       c = std::move(g);
+		check();
+
+		// now change something below c, which must still get up to the root
+		if(not c.is_terminal()) {
+			auto& d = c.child(myrandom(c.nchildren()));
+			d.assign(grammar.generate(d.nt()));
+			check();
+		}
+	}
+	COUT "GOOD" ENDL;
+
+
 	COUT "# MCMC...";
 	TopN<MyHypothesis> top_mcmc(N);  //	top_mcmc.print_best = true;
 	h0 = MyHypothesis::sample();
-	MCMCChain chain(h0, &mydata);
+	MCMCChain chain(h0, mydata);
 	for(auto& h : chain.run(Control())) { 
 		top_mcmc << h; 
 	}
@@ -246,7 +282,7 @@ int main(int argc, char** argv){
 	COUT "# Parallel Tempering...";
 	TopN<MyHypothesis> top_tempering(N);
 	h0 = MyHypothesis::sample();
-	ParallelTempering samp(h0, &mydata, 8, 1000.0);
+	ParallelTempering samp(h0, mydata, 8, 1000.0);
 	for(auto& h : samp.run(Control())) { 
 		top_tempering << h; 
 	}
@@ -262,7 +298,7 @@ int main(int argc, char** argv){
 
 	COUT "# Enumeration...";
 	TopN<MyHypothesis> top_enumerate(N);
-	EnumerationInference<MyHypothesis,MyGrammar,BasicEnumeration<MyGrammar>> e(&grammar, &mydata);
+	EnumerationInference<MyHypothesis,MyGrammar,BasicEnumeration<MyGrammar>> e(&grammar, mydata);
 	for(auto& h : e.run(Control())) {
 		top_enumerate << h;
 	}
@@ -0,0 +1,130 @@
+///########################################################################################
+// Benchmark for running deterministic programs as closures (see Closure.h) vs on a
+// VirtualMachineState. This samples a bunch of hypotheses from a RationalRules-style grammar,
+// checks that both give the same outputs on every object, and prints how long each takes.
+// The closure has to be compiled once per hypothesis, so the last column says about how many
+// calls it takes for that to pay off.
+///########################################################################################
+
+#include <chrono>
+
+#include "ShapeColorSizeObject.h"
+
+using MyObject = ShapeColorSizeObject;
+
+#include "Grammar.h"
+#include "Singleton.h"
+
+class MyGrammar : public Grammar<MyObject,bool,   MyObject, bool>,
+				  public Singleton<MyGrammar> {
+public:
+	MyGrammar() {
+		add("blue(%s)",       +[](MyObject x) -> bool { return x.is(Color::Blue); });
+		add("yellow(%s)",     +[](MyObject x) -> bool { return x.is(Color::Yellow); });
+		add("green(%s)",      +[](MyObject x) -> bool { return x.is(Color::Green); });
+
+		add("rectangle(%s)",  +[](MyObject x) -> bool { return x.is(Shape::Rectangle); });
+		add("triangle(%s)",   +[](MyObject x) -> bool { return x.is(Shape::Triangle); });
+		add("circle(%s)",     +[](MyObject x) -> bool { return x.is(Shape::Circle); });
+
+		add("size1(%s)",      +[](MyObject x) -> bool { return x.is(Size::size1); });
+		add("size2(%s)",      +[](MyObject x) -> bool { return x.is(Size::size2); });
+		add("size3(%s)",      +[](MyObject x) -> bool { return x.is(Size::size3); });
+
+		add("and(%s,%s)",     Builtins::And<MyGrammar>);
+		add("or(%s,%s)",      Builtins::Or<MyGrammar>);
+		add("not(%s)",        Builtins::Not<MyGrammar>);
+		add("implies(%s,%s)", Builtins::Implies<MyGrammar>);
+		add("iff(%s,%s)",     Builtins::Iff<MyGrammar>);
+		add("if(%s,%s,%s)",   Builtins::If<MyGrammar,bool>);
+
+		add("x",              Builtins::X<MyGrammar>);
+	}
+} grammar;
+
+#include "DeterministicLOTHypothesis.h"
+
+class MyHypothesis final : public DeterministicLOTHypothesis<MyHypothesis,MyObject,bool,MyGrammar,&grammar> {
+public:
+	using Super = DeterministicLOTHypothesis<MyHypothesis,MyObject,bool,MyGrammar,&grammar>;
+	using Super::Super;
+};
+
+#include "Fleet.h"
+#include "Builtins.h"
+
+int main(int argc, char** argv){
+
+	size_t nhyp = 10000; // how many hypotheses
+	size_t reps = 10;    // how many times to call each on each object
+
+	Fleet fleet("Closure benchmark");
+	fleet.add_option("--nhyp", nhyp, "How many hypotheses to sample");
+	fleet.add_option("--reps", reps, "How many times to call each hypothesis on each object");
+	fleet.initialize(argc, argv);
+	
+	VirtualMachineControl::USE_CLOSURES = true; // (compile_closure does nothing otherwise)
+
+	// every object
+	std::vector<MyObject> objects;
+	for(auto s : {"rectangle", "triangle", "circle"}) {
+		for(auto c : {"blue", "yellow", "green"}) {
+			for(auto z : {"1", "2", "3"}) {
+				objects.emplace_back(std::string(s)+"-"+c+"-"+z);
+			}
+		}
+	}
+
+	std::vector<MyHypothesis> hypotheses;
+	size_t nnodes = 0;
+	while(hypotheses.size() < nhyp) {
+		auto h = MyHypothesis::sample();
+		if(h.get_value().count() > FleetArgs::MAX_NODES) continue;
+		nnodes += h.get_value().count();
+		hypotheses.push_back(h);
+	}
+
+	using clock = std::chrono::high_resolution_clock;
+	auto ns = [](auto start) { return (double)std::chrono::duration_cast<std::chrono::nanoseconds>(clock::now()-start).count(); };
+
+	// run on VirtualMachineStates
+	std::vector<bool> vm_out;
+	auto start = clock::now();
+	for(auto& h : hypotheses) {
+		for(size_t r=0;r<reps;r++) {
+			for(const auto& x : objects) {
+				vm_out.push_back(h.call_vms(x, false));
+			}
+		}
+	}
+	const double vm_ns = ns(start);
+
+	// compile the closures
+	start = clock::now();
+	for(auto& h : hypotheses) {
+		h.compile_closure();
+		assert(h.closure != nullptr && "*** Every rule in this grammar should compile");
+	}
+	const double compile_ns = ns(start);
+
+	// run the closures
+	std::vector<bool> closure_out;
+	start = clock::now();
+	for(auto& h : hypotheses) {
+		for(size_t r=0;r<reps;r++) {
+			for(const auto& x : objects) {
+				closure_out.push_back(h.call_closure(x, false));
+			}
+		}
+	}
+	const double closure_ns = ns(start);
+
+	if(vm_out != closure_out) {
+		CERR "*** Closures and VirtualMachineStates gave different outputs!" ENDL;
+		return 1;
+	}
+
+	const double ncalls = vm_out.size();
+	COUT "# hypotheses" TAB "mean nodes" TAB "calls" TAB "VM ns/call" TAB "closure ns/call" TAB "compile ns/hypothesis" TAB "break-even calls" ENDL;
+	COUT nhyp TAB double(nnodes)/nhyp TAB ncalls TAB vm_ns/ncalls TAB closure_ns/ncalls TAB compile_ns/nhyp TAB (compile_ns/nhyp) / (vm_ns/ncalls - closure_ns/ncalls) ENDL;
+}
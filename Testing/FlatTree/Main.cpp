@@ -0,0 +1,110 @@
+///########################################################################################
+// Checks and benchmark for FlatTree on FormalLanguageTheory-Simple. This samples a bunch of 
+// hypotheses and checks that converting to a FlatTree and back gives the same Node, and that
+// FlatTree's log_probability, count, linearize, and regenerate agree with Node's. Then it 
+// prints how long it takes to copy (and compare) each representation. 
+///########################################################################################
+
+#include <chrono>
+
+#define DO_NOT_INCLUDE_MAIN 1 
+#include "../Models/FormalLanguageTheory-Simple/Main.cpp"
+
+#include "FlatTree.h"
+#include "Fleet.h" 
+
+int main(int argc, char** argv){ 
+	
+	size_t nhyp = 10000; // how many hypotheses
+	size_t reps = 100;   // how many times to copy each
+	
+	Fleet fleet("FlatTree benchmark");
+	fleet.add_option("-a,--alphabet", alphabet, "Alphabet we will use");
+	fleet.add_option("--nhyp",        nhyp,     "How many hypotheses to sample");
+	fleet.add_option("--reps",        reps,     "How many times to copy each hypothesis");
+	fleet.initialize(argc, argv);
+	
+	for(const char c : alphabet) {
+		grammar.add_terminal( Q(S(1,c)), c, 3.0/alphabet.length());
+	}
+	
+	std::vector<Node> nodes;
+	std::vector<FlatTree> flats;
+	size_t nnodes = 0;
+	while(nodes.size() < nhyp) {
+		auto n = grammar.generate();
+		if(n.count() > FleetArgs::MAX_NODES) continue;
+		nnodes += n.count();
+		nodes.push_back(n);
+		flats.emplace_back(n);
+	}
+	
+	// these add up the same numbers in a different order
+	auto close = [](double a, double b) { return std::abs(a-b) < 1e-9; };
+	
+	auto fail = [](const std::string& what, const Node& n) {
+		CERR "*** FlatTree and Node disagree on " << what << " for " << n.string() ENDL;
+		return 1;
+	};
+	
+	//------------------
+	// Check that everything agrees
+	//------------------
+	
+	for(size_t i=0;i<nhyp;i++) {
+		const Node& n = nodes[i];
+		const FlatTree& f = flats[i];
+		
+		if(not (f.to_node() == n))                                      return fail("to_node", n);
+		if(f.count() != n.count())                                      return fail("count", n);
+		if(f.hash() != FlatTree(f.to_node()).hash())                    return fail("hash", n);
+		if(not close(grammar.log_probability(f), grammar.log_probability(n))) return fail("log_probability", n);
+		
+		Program<MyHypothesis::VirtualMachineState_t> a, b;
+		n.linearize<MyHypothesis::VirtualMachineState_t,MyGrammar>(a);
+		f.linearize<MyHypothesis::VirtualMachineState_t,MyGrammar>(b);
+		if(a.size() != b.size()) return fail("linearize", n);
+		for(size_t k=0;k<a.size();k++) {
+			if(a[k].f != b[k].f or a[k].arg != b[k].arg or a[k].op != b[k].op or a[k].rule != b[k].rule) 
+				return fail("linearize", n);
+		}
+		
+		auto p = Proposals::regenerate(&grammar, f);
+		if(p) {
+			const Node pn = p->first.to_node();
+			if(not (FlatTree(pn) == p->first))                                         return fail("regenerate", n);
+			if(not close(grammar.log_probability(pn), grammar.log_probability(p->first))) return fail("regenerate", n);
+		}
+	}
+	
+	//------------------
+	// Time copies
+	//------------------
+	
+	using clock = std::chrono::high_resolution_clock;
+	auto seconds = [](auto start) { return std::chrono::duration<double>(clock::now()-start).count(); };
+	
+	size_t neq = 0; // so that nothing is optimized away
+	auto start = clock::now();
+	for(size_t r=0;r<reps;r++) {
+		for(const auto& n : nodes) {
+			Node c = n;
+			neq += (c == n);
+		}
+	}
+	const double node_time = seconds(start);
+	
+	start = clock::now();
+	for(size_t r=0;r<reps;r++) {
+		for(const auto& f : flats) {
+			FlatTree c = f;
+			neq += (c == f);
+		}
+	}
+	const double flat_time = seconds(start);
+	
+	assert(neq == 2*reps*nhyp);
+	
+	COUT "# hypotheses" TAB "mean nodes" TAB "Node copy+compare seconds" TAB "FlatTree copy+compare seconds" ENDL;
+	COUT nhyp TAB double(nnodes)/nhyp TAB node_time TAB flat_time ENDL;
+}
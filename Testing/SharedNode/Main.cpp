@@ -0,0 +1,110 @@
+///########################################################################################
+// Checks and benchmark for SharedNode (hash-consed trees) on FormalLanguageTheory-Simple. 
+// This samples hypotheses and checks that converting to a SharedNode and back gives the same 
+// Node, and that equality, counts, and log_probability agree with Node's. Then it runs a 
+// random walk of regeneration proposals on each representation, keeping every tree (as TopN 
+// or a chain's history would), and prints how long the proposals took and how many nodes 
+// each had to store. 
+///########################################################################################
+
+#include <chrono>
+
+#define DO_NOT_INCLUDE_MAIN 1 
+#include "../Models/FormalLanguageTheory-Simple/Main.cpp"
+
+#include "SharedNode.h"
+#include "Fleet.h" 
+
+int main(int argc, char** argv){ 
+	
+	size_t nhyp   = 10000; // how many hypotheses to check
+	size_t nsteps = 100000; // how many proposals in the random walk
+	
+	Fleet fleet("SharedNode benchmark");
+	fleet.add_option("-a,--alphabet", alphabet, "Alphabet we will use");
+	fleet.add_option("--nhyp",        nhyp,     "How many hypotheses to check");
+	fleet.add_option("--nsteps",      nsteps,   "How many proposals to make");
+	fleet.initialize(argc, argv);
+	
+	for(const char c : alphabet) {
+		grammar.add_terminal( Q(S(1,c)), c, 3.0/alphabet.length());
+	}
+	
+	// these add up the same numbers in a different order
+	auto close = [](double a, double b) { return std::abs(a-b) < 1e-9; };
+	
+	auto fail = [](const std::string& what, const Node& n) {
+		CERR "*** SharedNode and Node disagree on " << what << " for " << n.string() ENDL;
+		return 1;
+	};
+	
+	//------------------
+	// Check that everything agrees
+	//------------------
+	
+	std::vector<Node> nodes;
+	std::vector<SharedNode> shared;
+	while(nodes.size() < nhyp) {
+		auto n = grammar.generate();
+		if(n.count() > FleetArgs::MAX_NODES) continue;
+		nodes.push_back(n);
+		shared.emplace_back(n);
+	}
+	
+	for(size_t i=0;i<nhyp;i++) {
+		const Node& n = nodes[i];
+		const SharedNode& s = shared[i];
+		
+		if(not (s.to_node() == n))                                              return fail("to_node", n);
+		if(not (SharedNode(s.to_node()) == s))                                  return fail("sharing", n);
+		if(s.count() != n.count())                                              return fail("count", n);
+		if(not close(grammar.log_probability(s), grammar.log_probability(n)))  return fail("log_probability", n);
+		
+		// equal Nodes (with the same can_resample) must be the same SharedNode
+		const size_t j = myrandom(nhyp);
+		if((nodes[j] == n) != (shared[j] == s))                                 return fail("equality", n);
+		
+		auto p = Proposals::regenerate(&grammar, s);
+		if(p) {
+			const Node pn = p->first.to_node();
+			if(not (SharedNode(pn) == p->first))                                          return fail("regenerate", n);
+			if(not close(grammar.log_probability(pn), grammar.log_probability(p->first)))  return fail("regenerate", n);
+		}
+	}
+	nodes.clear();
+	shared.clear();
+	
+	//------------------
+	// A random walk, keeping every tree 
+	//------------------
+	
+	using clock = std::chrono::high_resolution_clock;
+	auto seconds = [](auto start) { return std::chrono::duration<double>(clock::now()-start).count(); };
+	
+	Node n0;
+	do { n0 = grammar.generate(); } while(n0.count() > FleetArgs::MAX_NODES);
+	
+	// proposals that make the tree too big are rejected, so that the walk stays a reasonable size
+	size_t node_total = 0;
+	auto start = clock::now();
+	nodes.push_back(n0);
+	for(size_t i=0;i<nsteps;i++) {
+		auto p = Proposals::regenerate(&grammar, nodes.back());
+		if(p and p->first.count() <= FleetArgs::MAX_NODES) nodes.push_back(std::move(p->first));
+		else                                               nodes.push_back(nodes.back());
+		node_total += nodes.back().count();
+	}
+	const double node_time = seconds(start);
+	
+	start = clock::now();
+	shared.push_back(SharedNode(n0));
+	for(size_t i=0;i<nsteps;i++) {
+		auto p = Proposals::regenerate(&grammar, shared.back());
+		if(p and p->first.count() <= FleetArgs::MAX_NODES) shared.push_back(std::move(p->first));
+		else                                               shared.push_back(shared.back());
+	}
+	const double shared_time = seconds(start);
+	
+	COUT "# steps" TAB "Node seconds" TAB "SharedNode seconds" TAB "Nodes stored" TAB "SharedNodes stored" ENDL;
+	COUT nsteps TAB node_time TAB shared_time TAB node_total TAB SharedNode::table_size() ENDL;
+}
@@ -0,0 +1,110 @@
+///########################################################################################
+// Benchmark for superinstructions (see Grammar::add_superinstruction) on 
+// FormalLanguageTheory-Simple. This runs MCMC to find some good hypotheses, counts which 
+// chains of instructions are most common in them (Grammar::count_chains), adds those as 
+// superinstructions, and then compares how many instructions (and how long) it takes to 
+// call every hypothesis on the data before and after. The outputs must be the same. 
+///########################################################################################
+
+#include <chrono>
+
+#define DO_NOT_INCLUDE_MAIN 1 
+#include "../Models/FormalLanguageTheory-Simple/Main.cpp"
+
+#include "TopN.h"
+#include "ParallelTempering.h"
+#include "Fleet.h" 
+
+int main(int argc, char** argv){ 
+	
+	size_t nsuper = 8;  // how many superinstructions to add?
+	size_t maxlen = 3;  // longest chain to consider
+	size_t reps   = 10; // how many times to call each hypothesis on the data
+	
+	FleetArgs::steps = 10000; 
+	
+	Fleet fleet("Superinstruction benchmark");
+	fleet.add_option("-a,--alphabet",        alphabet, "Alphabet we will use");
+	fleet.add_option("-d,--data",            datastr,  "Comma separated list of input data strings");	
+	fleet.add_option("--superinstructions",  nsuper,   "How many superinstructions to add");
+	fleet.add_option("--maxlen",             maxlen,   "The longest superinstruction to consider");
+	fleet.add_option("--reps",               reps,     "How many times to call each hypothesis on the data");
+	fleet.initialize(argc, argv);
+	
+	for(const char c : alphabet) {
+		grammar.add_terminal( Q(S(1,c)), c, 3.0/alphabet.length());
+	}
+	
+	VirtualMachineControl::MAX_STEPS = 256;
+	VirtualMachineControl::MAX_OUTPUTS = 256;
+	
+	auto mydata = string_to<std::vector<MyHypothesis::datum_t>>(datastr);
+	
+	//------------------
+	// Find some hypotheses
+	//------------------
+	
+	TopN<MyHypothesis> top(100);
+	auto h0 = MyHypothesis::sample();
+	ParallelTempering samp(h0, mydata, FleetArgs::nchains, 1.20);
+	for(auto& h : samp.run(Control()) | top) {
+		UNUSED(h);
+	}
+	auto hypotheses = top.sorted();
+	
+	//------------------
+	// Call all of them and count instructions
+	//------------------
+	
+	using clock = std::chrono::high_resolution_clock;
+	auto run = [&](std::vector<MyHypothesis>& hs, std::vector<std::string>& outputs) -> std::pair<unsigned long, double> {
+		unsigned long instructions = 0;
+		auto start = clock::now();
+		for(size_t r=0;r<reps;r++) {
+			for(auto& h : hs) {
+				for(const auto& di : mydata) {
+					auto o = h.call(di.input, "<err>");
+					instructions += h.total_instruction_count_last_call;
+					if(r == 0) outputs.push_back(o.string());
+				}
+			}
+		}
+		return {instructions, std::chrono::duration<double>(clock::now()-start).count()};
+	};
+	
+	std::vector<std::string> before_out, after_out;
+	auto [before_instructions, before_time] = run(hypotheses, before_out);
+	
+	//------------------
+	// Add the most common chains as superinstructions and recompile
+	//------------------
+	
+	std::map<std::vector<const Rule*>,size_t> counts;
+	for(const auto& h : hypotheses) {
+		grammar.count_chains(h.get_value(), counts, maxlen);
+	}
+	
+	std::vector<std::pair<std::vector<const Rule*>,size_t>> v(counts.begin(), counts.end());
+	std::stable_sort(v.begin(), v.end(), [](const auto& a, const auto& b) { return a.second > b.second; });
+	COUT "# Most common chains (count, then rules):" ENDL;
+	for(size_t i=0;i<std::min(nsuper, v.size());i++) {
+		std::string s; 
+		for(auto r : v[i].first) s += r->format + " ";
+		COUT "#\t" << v[i].second TAB s ENDL;
+	}
+	
+	grammar.add_superinstructions(counts, nsuper);
+	for(auto& h : hypotheses) {
+		h.compile();
+	}
+	
+	auto [after_instructions, after_time] = run(hypotheses, after_out);
+	
+	if(before_out != after_out) {
+		CERR "*** Superinstructions changed the outputs!" ENDL;
+		return 1;
+	}
+	
+	COUT "# hypotheses" TAB "instructions.before" TAB "instructions.after" TAB "pct.instructions" TAB "seconds.before" TAB "seconds.after" ENDL;
+	COUT hypotheses.size() TAB before_instructions TAB after_instructions TAB 100.0*after_instructions/before_instructions TAB before_time TAB after_time ENDL;
+}
@@ -0,0 +1,91 @@
+///########################################################################################
+// Check that Grammar::generate, which samples trees that fit under GRAMMAR_MAX_DEPTH directly (see
+// build_truncation_tables), gives the same distribution as generating and retrying on DepthException. 
+// This uses a small recursive grammar and a low bound, so that most trees would go past it, and checks
+// that each sampler's frequencies match truncated_log_probability, and that the two samplers match
+// each other, to within sampling noise. 
+///########################################################################################
+
+#include <map>
+
+#define DO_NOT_INCLUDE_MAIN 1 
+#include "../Models/FormalLanguageTheory-Simple/Main.cpp"
+
+#include "Fleet.h" 
+
+class TreeGrammar : public Grammar<S,S,  S,bool>,
+				    public Singleton<TreeGrammar> {
+public:
+	TreeGrammar() {
+		add("(%s)%s",     +[](S x, S y)         -> S { throw YouShouldNotBeHereError(); }, 2.0);
+		add("%s?%s:%s",   +[](bool b, S x, S y) -> S { throw YouShouldNotBeHereError(); }, 1.0);
+		add("x",          +[]()                 -> S { throw YouShouldNotBeHereError(); }, 1.0);
+		add("not(%s)",    +[](bool b)           -> bool { throw YouShouldNotBeHereError(); }, 1.0);
+		add("b",          +[]()                 -> bool { throw YouShouldNotBeHereError(); }, 1.0);
+	}
+};
+
+int main(int argc, char** argv){ 
+	
+	size_t nsamples = 200000; // how many trees from each sampler
+	size_t maxdepth = 5;
+	
+	Fleet fleet("Truncated generate check");
+	fleet.add_option("--nsamples", nsamples, "How many trees to sample with each method");
+	fleet.add_option("--maxdepth", maxdepth, "The grammar's max depth");
+	fleet.initialize(argc, argv);
+	
+	TreeGrammar g;
+	g.set_max_depth(maxdepth);
+	const auto nt = g.nt<S>();
+	
+	std::map<std::string,double> truncated, retry;
+	std::map<std::string,double> lp; // truncated_log_probability of each tree we saw
+	size_t nretries = 0;
+	for(size_t i=0;i<nsamples and !CTRL_C;i++) {
+		const Node t = g.generate(nt);
+		truncated[t.parseable()] += 1.0/nsamples;
+		lp[t.parseable()] = g.truncated_log_probability(t);
+		
+		while(true) {
+			try {
+				const Node r = g.__generate(nt);
+				retry[r.parseable()] += 1.0/nsamples;
+				lp[r.parseable()] = g.truncated_log_probability(r);
+				break;
+			} catch(DepthException& e) {
+				nretries++;
+			}
+		}
+	}
+	
+	// total variation distance between two distributions on trees (missing means zero)
+	auto tv = [&](auto p, auto q) {
+		double d = 0.0;
+		for(const auto& [t, _] : lp) {
+			d += std::abs(p(t)-q(t));
+		}
+		return d/2.0;
+	};
+	auto freq = [](const auto& m) { return [&m](const std::string& t) { return m.contains(t) ? m.at(t) : 0.0; }; };
+	auto exact = [&](const std::string& t) { return exp(lp.at(t)); };
+	
+	// the probability of every tree we saw should be at most 1 in total (and close to it, since we see most)
+	double seen = 0.0;
+	for(const auto& [t, l] : lp) seen += exp(l);
+	
+	const double d_truncated = tv(freq(truncated), exact);
+	const double d_retry     = tv(freq(retry), exact);
+	const double d_both      = tv(freq(truncated), freq(retry));
+	
+	COUT "# trees seen" TAB "mass seen" TAB "retries per sample" TAB "TV(truncated,exact)" TAB "TV(retry,exact)" TAB "TV(truncated,retry)" ENDL;
+	COUT lp.size() TAB seen TAB double(nretries)/nsamples TAB d_truncated TAB d_retry TAB d_both ENDL;
+	
+	// Each is sum |f-p|/2 over the K trees we saw. With n samples, E|f-p| <= sqrt(p/n) for each tree, and so the 
+	// expected sum is at most sqrt(K/n); we allow twice the expected TV for each, and for their difference
+	const double bound = sqrt(double(lp.size())/nsamples);
+	if(seen > 1.0+1e-9 or d_truncated > bound or d_retry > bound or d_both > bound) {
+		CERR "*** Truncated and retry sampling disagree (bound " << bound << ")" ENDL;
+		return 1;
+	}
+}
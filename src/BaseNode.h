@@ -1,6 +1,7 @@
 #pragma once 
 
 #include<vector>
+#include<memory>
 #include<string>
 
 #include "Errors.h"
@@ -16,11 +17,11 @@
  * 		  an attempt to make a big superclass that puts all of this functionality in one place. It attempts 
  * 		  to keep the node size small so that we can use this efficiently in MCTS in particular. 
  */
-template<typename this_t>
+template<typename this_t, typename allocator_t=std::allocator<this_t>>
 class BaseNode { 
 
 protected:
-	std::vector<this_t> children;
+	std::vector<this_t,allocator_t> children;
 	
 public:
 	this_t* parent; 
@@ -54,10 +55,11 @@ public:
 		children = t.children;
 		fix_child_info();
 	}
-	void operator=(const this_t&& t) {
+	void operator=(this_t&& t) {
 		parent = t.parent;
 		pi = t.pi;
-		children = std::move(t.children);
+		auto c = std::move(t.children); // (t might be one of our children, so don't free them until t's are taken)
+		children = std::move(c);
 		fix_child_info();
 	}
 	
@@ -154,13 +156,19 @@ public:
 	static NodeIterator EndNodeIterator; // defined below
 	////////////////////////////////////////////////////////////////////////////
 	
-	NodeIterator begin() const { return BaseNode<this_t>::NodeIterator(static_cast<const this_t*>(this)); }
-	NodeIterator end()   const { return BaseNode<this_t>::EndNodeIterator; }
+	NodeIterator begin() const { return BaseNode<this_t,allocator_t>::NodeIterator(static_cast<const this_t*>(this)); }
+	NodeIterator end()   const { return BaseNode<this_t,allocator_t>::EndNodeIterator; }
 
 	virtual bool operator!=(const this_t& n) const{
 		return not (*this == n);
 	}
 
+	/**
+	 * @brief This is called whenever set_child changes one of my children. Subclasses can hide this (e.g. so that Node 
+	 * 		  can update what it caches about its subtree).
+	 */
+	void children_changed() { }
+
 	void reserve_children(const size_t n) {
 		children.reserve(n);
 	}
@@ -293,6 +301,7 @@ public:
 		children[i] = n;
 		children[i].pi = i;
 		children[i].parent = static_cast<this_t*>(this);
+		static_cast<this_t*>(this)->children_changed();
 	}
 	void set_child(const size_t i, this_t&& n) {
 		/**
@@ -305,16 +314,17 @@ public:
 		while(children.size() <= i) // make it big enough for i  
 			children.push_back(this_t());
 
-		children[i] = n;
+		children[i] = std::move(n);
 		children[i].pi = i;
 		children[i].parent = static_cast<this_t*>(this);
+		static_cast<this_t*>(this)->children_changed();
 	}
 	
 	void push_back(this_t& n) {
 		set_child(children.size(), n);
 	}
 	void push_back(this_t&& n) {
-		set_child(children.size(), n);
+		set_child(children.size(), std::move(n));
 	}
 
 	/**
@@ -486,13 +496,13 @@ public:
 };
 
 
-template<typename this_t>
-typename BaseNode<this_t>::NodeIterator BaseNode<this_t>::EndNodeIterator = NodeIterator(nullptr);
+template<typename this_t, typename allocator_t>
+typename BaseNode<this_t,allocator_t>::NodeIterator BaseNode<this_t,allocator_t>::EndNodeIterator = NodeIterator(nullptr);
 
 
 
-template<typename this_t>
-std::ostream& operator<<(std::ostream& o, const BaseNode<this_t>& t) {
+template<typename this_t, typename allocator_t>
+std::ostream& operator<<(std::ostream& o, const BaseNode<this_t,allocator_t>& t) {
 	o << t.string();
 	return o;
 }
\ No newline at end of file
@@ -0,0 +1,79 @@
+#pragma once
+
+#include <memory>
+
+/**
+ * @class CopyOnWrite
+ * @author Steven Piantadosi
+ * @date 18/10/26
+ * @file CopyOnWrite.h
+ * @brief Holds a T that is shared between copies until one of them modifies it. Copying a CopyOnWrite therefore
+ * 		  only copies a pointer, and the T is only copied (once) by whichever copy first calls modify(). This is
+ * 		  used in VirtualMachineState so that branching at a random choice doesn't copy e.g. the memoization maps.
+ * 		  The T is not allocated until it is first modified.
+ */
+template<typename T>
+class CopyOnWrite {
+
+	std::shared_ptr<T> value;
+
+	// what get() returns when we haven't made anything yet
+	static const T& empty_value() {
+		static const T e{};
+		return e;
+	}
+
+public:
+
+	CopyOnWrite() { }
+
+	/**
+	 * @brief Read-only access (never copies)
+	 * @return
+	 */
+	const T& get() const {
+		return value == nullptr ? empty_value() : *value;
+	}
+
+	/**
+	 * @brief Access that we can change -- this makes a copy first if we are sharing with someone else
+	 * @return
+	 */
+	T& modify() {
+		if(value == nullptr) {
+			value = std::make_shared<T>();
+		}
+		else if(value.use_count() > 1) {
+			value = std::make_shared<T>(*value);
+		}
+		return *value;
+	}
+
+	/**
+	 * @brief Go back to an empty T. If we are the only one with our value, we just clear it (so we do not have to allocate it again)
+	 */
+	void clear() {
+		if(value == nullptr) return;
+		if(value.use_count() > 1) value.reset();
+		else                      value->clear();
+	}
+
+	/**
+	 * @brief Make our own copy of the value (if we have one), whether or not it looks shared. use_count is not a reliable
+	 * 		  way to tell whether another thread is using the value, so VirtualMachinePool calls this when it hands a state
+	 * 		  to another thread. After that, anything sharing with us again was made by that thread.
+	 */
+	void unshare() {
+		if(value != nullptr) {
+			value = std::make_shared<T>(*value);
+		}
+	}
+
+	/**
+	 * @brief Are we sharing our value with any other copies?
+	 * @return
+	 */
+	bool is_shared() const {
+		return value != nullptr and value.use_count() > 1;
+	}
+};
@@ -0,0 +1,145 @@
+#pragma once
+
+#include <vector>
+#include <utility>
+#include <functional>
+#include <assert.h>
+
+#include "Miscellaneous.h"
+
+/**
+ * @class MemoTable
+ * @author Steven Piantadosi
+ * @date 18/10/26
+ * @file MemoTable.h
+ * @brief A hash table (open addressing with linear probing) that VirtualMachineState uses to store memoized values.
+ * 		  A key's hash is computed once, when it is made into a HashedKey (e.g. by MemRecurse), and is stored with it
+ * 		  and in the table, so lookups only compare keys (e.g. strings) when the whole hash matches, and growing the
+ * 		  table never rehashes a key. Entries are never removed (except by clear), and emplace does not overwrite.
+ * 		  NOTE: K and V must be default constructible, since empty slots hold default values.
+ */
+template<typename K, typename V>
+class MemoTable {
+public:
+
+	struct HashedKey {
+		K key;
+		size_t hash;
+	};
+
+	/**
+	 * @brief Compute the hash for k once, so that it can be used for both looking up and storing.
+	 * 		  The top bit is always set, since a hash of zero marks an empty slot.
+	 * @param k
+	 * @return
+	 */
+	static HashedKey make_key(K k) {
+		size_t h;
+		if constexpr (is_specialization<K,std::pair>::value) {
+			h = std::hash<typename K::first_type>{}(k.first);
+			hash_combine(h, k.second);
+		}
+		else {
+			h = std::hash<K>{}(k);
+		}
+		return HashedKey{std::move(k), h | (size_t(1) << (8*sizeof(size_t)-1))};
+	}
+
+private:
+
+	struct Slot {
+		size_t hash = 0; // 0 means this is empty
+		K key;
+		V value;
+	};
+
+	std::vector<Slot> slots; // the size is always zero or a power of two
+	size_t n = 0;
+
+	/**
+	 * @brief Double the number of slots, moving everything over (using their stored hashes)
+	 */
+	void grow() {
+		std::vector<Slot> old(std::max<size_t>(16, 2*slots.size()));
+		std::swap(old, slots);
+
+		const size_t mask = slots.size()-1;
+		for(auto& s : old) {
+			if(s.hash == 0) continue;
+			size_t i = s.hash & mask;
+			while(slots[i].hash != 0) i = (i+1) & mask;
+			slots[i] = std::move(s);
+		}
+	}
+
+public:
+
+	/**
+	 * @brief Return a pointer to the value stored for k, or nullptr if there isn't one
+	 * @param k
+	 * @return
+	 */
+	const V* find(const HashedKey& k) const {
+		if(n == 0) return nullptr;
+
+		const size_t mask = slots.size()-1;
+		for(size_t i=k.hash & mask; ; i=(i+1) & mask) {
+			const Slot& s = slots[i];
+			if(s.hash == 0) return nullptr;
+			if(s.hash == k.hash and s.key == k.key) return &s.value;
+		}
+	}
+
+	/**
+	 * @brief Store v for k, unless k already has a value
+	 * @param k
+	 * @param v
+	 */
+	void emplace(HashedKey&& k, const V& v) {
+		if(2*(n+1) > slots.size()) grow(); // keep the load at most 1/2 so probes stay short
+
+		const size_t mask = slots.size()-1;
+		for(size_t i=k.hash & mask; ; i=(i+1) & mask) {
+			Slot& s = slots[i];
+			if(s.hash == 0) {
+				s.hash  = k.hash;
+				s.key   = std::move(k.key);
+				s.value = v;
+				n++;
+				return;
+			}
+			if(s.hash == k.hash and s.key == k.key) return;
+		}
+	}
+
+	size_t count(const K& k) const {
+		return find(make_key(k)) != nullptr;
+	}
+
+	size_t size() const {
+		return n;
+	}
+
+	bool empty() const {
+		return n == 0;
+	}
+	
+	/**
+	 * @brief About how many bytes do we use? (Not counting anything the keys or values allocate themselves)
+	 * @return
+	 */
+	size_t memory() const {
+		return slots.capacity()*sizeof(Slot);
+	}
+
+	/**
+	 * @brief Remove everything, but keep the slots so that we don't have to allocate them again
+	 */
+	void clear() {
+		if(n == 0) return;
+		for(auto& s : slots) {
+			s = Slot{};
+		}
+		n = 0;
+	}
+};
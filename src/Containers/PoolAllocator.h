@@ -0,0 +1,132 @@
+#pragma once
+
+#include <new>
+#include <cstddef>
+
+#include "Statistics/FleetStatistics.h"
+
+/**
+ * @class PoolAllocator
+ * @author Steven Piantadosi
+ * @date 18/10/26
+ * @file PoolAllocator.h
+ * @brief A std-compatible allocator that keeps a per-thread free list for each small array size (up to MAX_POOLED
+ * 		  elements). Node uses this for its children (see BaseNode), since nearly all of those arrays have a rule's
+ * 		  handful of arguments, and proposals make and throw away trees all the time. Freeing a block puts it on the
+ * 		  current thread's list and allocating takes from there first, so the global allocator (which contends across
+ * 		  threads) is only used when a thread's list is empty or full. A thread keeps at most MAX_FREE_BYTES of free
+ * 		  blocks (of all sizes together), so that with many threads, memory one thread freed isn't kept from the others.
+ * 		  Blocks may be freed by a different thread than allocated them (e.g. hypotheses passed between chains), since
+ * 		  each block is its own ::operator new allocation.
+ * 		  The counts are kept per thread and added into FleetStatistics every so often and when the thread exits.
+ */
+template<typename T>
+class PoolAllocator {
+
+	struct FreeBlock {
+		FreeBlock* next;
+	};
+
+public:
+	using value_type = T;
+
+	static constexpr size_t MAX_POOLED     = 8;       // arrays of up to this many T are pooled
+	static constexpr size_t MAX_FREE_BYTES = 4 << 20; // the most bytes of free blocks (of all sizes) that a thread keeps
+	static constexpr size_t FLUSH          = 1 << 12; // how often (in allocations) to add our counts into FleetStatistics
+
+private:
+
+	struct Pool {
+		FreeBlock* free[MAX_POOLED+1] = {};
+		size_t     free_bytes = 0; // total size of the blocks on our lists
+
+		// counts that have not yet been added to FleetStatistics
+		uintmax_t allocations = 0;
+		uintmax_t reuses = 0;
+		intmax_t  bytes = 0;
+
+		void flush() {
+			FleetStatistics::node_allocations += allocations;
+			FleetStatistics::node_allocation_reuses += reuses;
+			FleetStatistics::node_pool_bytes += bytes; // (this wraps around when bytes<0, which is what we want)
+			allocations = reuses = 0;
+			bytes = 0;
+		}
+
+		~Pool() {
+			for(size_t n=1;n<=MAX_POOLED;n++) {
+				while(free[n] != nullptr) {
+					FreeBlock* b = free[n];
+					free[n] = b->next;
+					bytes -= n*sizeof(T);
+					::operator delete(b);
+				}
+			}
+			flush();
+			destroyed() = true; // anything freed after this (e.g. by static destructors) goes straight to the global allocator
+		}
+	};
+
+	static bool& destroyed() {
+		thread_local bool d = false;
+		return d;
+	}
+
+	static Pool& pool() {
+		thread_local Pool p;
+		return p;
+	}
+
+public:
+
+	PoolAllocator() noexcept {}
+
+	template<typename U>
+	PoolAllocator(const PoolAllocator<U>&) noexcept {}
+
+	T* allocate(size_t n) {
+		static_assert(sizeof(T) >= sizeof(FreeBlock), "*** PoolAllocator needs T to be large enough to hold a pointer");
+		
+		if(n == 0 or n > MAX_POOLED or destroyed()) {
+			return static_cast<T*>(::operator new(n*sizeof(T)));
+		}
+
+		Pool& p = pool();
+		if(++p.allocations >= FLUSH) {
+			p.flush();
+		}
+
+		if(FreeBlock* b = p.free[n]) {
+			p.free[n] = b->next;
+			p.free_bytes -= n*sizeof(T);
+			p.reuses++;
+			p.bytes -= n*sizeof(T);
+			return reinterpret_cast<T*>(b);
+		}
+		return static_cast<T*>(::operator new(n*sizeof(T)));
+	}
+
+	void deallocate(T* x, size_t n) noexcept {
+		if(n == 0 or n > MAX_POOLED or destroyed()) {
+			::operator delete(x);
+			return;
+		}
+
+		Pool& p = pool();
+		if(p.free_bytes + n*sizeof(T) > MAX_FREE_BYTES) {
+			::operator delete(x);
+			return;
+		}
+
+		FreeBlock* b = reinterpret_cast<FreeBlock*>(x);
+		b->next = p.free[n];
+		p.free[n] = b;
+		p.free_bytes += n*sizeof(T);
+		p.bytes += n*sizeof(T);
+	}
+
+	template<typename U>
+	bool operator==(const PoolAllocator<U>&) const noexcept {
+		return true;
+	}
+};
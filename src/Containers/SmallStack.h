@@ -0,0 +1,304 @@
+#pragma once
+
+#include <vector>
+#include <algorithm>
+#include <atomic>
+#include <memory>
+#include <new>
+#include <utility>
+#include <assert.h>
+
+#include "Strings.h"
+
+/**
+ * @class SmallStack
+ * @author Steven Piantadosi
+ * @date 18/10/26
+ * @file SmallStack.h
+ * @brief A stack with the same interface as Stack, except that the first N elements are stored inline in the
+ * 		  object itself, and we only go to the heap when we need more than N. This is used in VirtualMachineState
+ * 		  where nearly all stacks are very shallow, so that constructing and copying a VirtualMachineState does not
+ * 		  need to allocate anything. Only the elements actually on the stack are copied.
+ * 		  Once a stack has moved to the heap, copies share the heap storage until one of them changes it
+ * 		  (copy-on-write). This way when a VirtualMachinePool branches a state at a random choice, deep stacks
+ * 		  are only copied by the branches that actually modify them.
+ */
+template<typename T, size_t N>
+class SmallStack {
+
+	static_assert(N > 0);
+
+	/**
+	 * @brief Where elements go once there are too many for local. This is a reference counted block with the
+	 * 		  elements stored right after the header, so that moving to the heap (or copying a shared one) is
+	 * 		  only a single allocation. We can't use a std::vector because std::vector<bool> doesn't store bools.
+	 * 		  NOTE: Copies that share a Heap never change it, so they all agree on how many elements it has; that
+	 * 		  is why the count is kept in the SmallStack rather than here.
+	 */
+	struct Heap {
+		std::atomic<size_t> refs;
+
+		static constexpr size_t offset() { return (sizeof(Heap)+alignof(T)-1)/alignof(T)*alignof(T); }
+
+		T* data() { return reinterpret_cast<T*>(reinterpret_cast<char*>(this)+offset()); }
+
+		static Heap* make(size_t c) {
+			static_assert(alignof(T) <= __STDCPP_DEFAULT_NEW_ALIGNMENT__);
+			Heap* h = new (::operator new(offset() + c*sizeof(T))) Heap;
+			h->refs = 1;
+			return h;
+		}
+	};
+
+	T* ptr; // where our elements are -- either local or heap->data()
+	size_t n; // how many elements are there?
+	size_t cap; // how many can ptr store?
+	Heap* heap; // nullptr if we are using local
+	mutable bool shared; // might heap be shared with a copy? (If so we check before changing anything)
+	alignas(T) unsigned char local[N*sizeof(T)];
+
+	T*       local_ptr()       { return reinterpret_cast<T*>(local); }
+	const T* local_ptr() const { return reinterpret_cast<const T*>(local); }
+
+	/**
+	 * @brief Let go of our elements and storage. If someone else still has our heap, they keep the elements.
+	 */
+	void release() {
+		if(heap == nullptr) {
+			std::destroy(ptr, ptr+n);
+		}
+		else if(heap->refs.fetch_sub(1, std::memory_order_acq_rel) == 1) {
+			std::destroy(ptr, ptr+n);
+			heap->~Heap();
+			::operator delete(heap);
+		}
+		ptr = local_ptr(); n = 0; cap = N; heap = nullptr; shared = false;
+	}
+
+	/**
+	 * @brief Put our elements into a new heap (that only we have) with room for c elements. We move them
+	 * 		  unless someone else also has them, in which case we copy.
+	 * @param c
+	 */
+	void rehome(size_t c) {
+		assert(c >= n);
+		Heap* h = Heap::make(c);
+		T* p = h->data();
+		const size_t k = n;
+		if(shared and heap->refs.load(std::memory_order_acquire) > 1) std::uninitialized_copy(ptr, ptr+n, p);
+		else                                                          std::uninitialized_move(ptr, ptr+n, p);
+		release();
+		ptr = p; n = k; cap = c; heap = h;
+	}
+
+	/**
+	 * @brief Before changing anything, make sure nobody else is using our heap.
+	 */
+	[[gnu::noinline]] void own() {
+		if(heap->refs.load(std::memory_order_acquire) > 1) {
+			rehome(cap);
+		}
+		shared = false;
+	}
+
+	/**
+	 * @brief The slow part of push, when we have run out of room or might be shared. This is kept out of line so
+	 * 		  that push can be inlined.
+	 * @param val
+	 */
+	template<typename X>
+	[[gnu::noinline]] void slow_push(X&& val) {
+		T tmp(std::forward<X>(val)); // val might be one of our own elements, so get it before anything moves
+		if(shared) own();
+		if(n == cap) rehome(2*cap);
+		new (ptr+n) T(std::move(tmp));
+		n++;
+	}
+
+	void copy_from(const SmallStack& s) {
+		if(s.heap != nullptr and s.n > N) {
+			// just share it
+			s.heap->refs.fetch_add(1, std::memory_order_relaxed);
+			ptr = s.ptr; n = s.n; cap = s.cap; heap = s.heap;
+			shared = s.shared = true;
+		}
+		else {
+			// if it fits, we copy into local (even if s is on the heap) so that we don't stay on the heap once a deep stack has gone back down
+			std::uninitialized_copy(s.ptr, s.ptr+s.n, local_ptr());
+			n = s.n;
+		}
+	}
+
+	void move_from(SmallStack&& s) {
+		if(s.heap != nullptr) {
+			ptr = s.ptr; n = s.n; cap = s.cap; heap = s.heap; shared = s.shared;
+			s.ptr = s.local_ptr(); s.n = 0; s.cap = N; s.heap = nullptr; s.shared = false;
+		}
+		else {
+			std::uninitialized_move(s.ptr, s.ptr+s.n, local_ptr());
+			n = s.n;
+			s.clear();
+		}
+	}
+
+public:
+
+	SmallStack() : ptr(local_ptr()), n(0), cap(N), heap(nullptr), shared(false) { }
+
+	SmallStack(const SmallStack& s) : SmallStack() {
+		copy_from(s);
+	}
+
+	SmallStack(SmallStack&& s) : SmallStack() {
+		move_from(std::move(s));
+	}
+
+	SmallStack& operator=(const SmallStack& s) {
+		if(this != &s) {
+			if(s.heap != nullptr and s.n > N) {
+				release();
+				copy_from(s); // shares s's heap
+			}
+			else {
+				clear(); // this keeps our own heap if we have one, and it (or local) is big enough
+				std::uninitialized_copy(s.ptr, s.ptr+s.n, ptr);
+				n = s.n;
+			}
+		}
+		return *this;
+	}
+
+	SmallStack& operator=(SmallStack&& s) {
+		if(this != &s) {
+			release();
+			move_from(std::move(s));
+		}
+		return *this;
+	}
+
+	~SmallStack() {
+		release();
+	}
+
+	template<typename... Args>
+	void emplace_back(Args... args) {
+		push(T(args...));
+	}
+
+	/**
+	 * @brief Make sure we can store t without allocating again
+	 * @param t
+	 */
+	void reserve(size_t t) {
+		if(shared) own();
+		if(t > cap) rehome(t);
+	}
+
+	/**
+	 * @brief Remove everything. If we have our own heap, we keep it around to use again.
+	 */
+	void clear() {
+		if(shared and heap->refs.load(std::memory_order_acquire) > 1) {
+			release(); // don't touch anyone else's
+		}
+		else {
+			std::destroy(ptr, ptr+n);
+			n = 0;
+			shared = false;
+		}
+	}
+
+	/**
+	* @brief Push val onto the stack
+	* @param val
+	*/
+	void push(const T& val) {
+		if(n < cap and not shared) {
+			[[likely]]
+			new (ptr+n) T(val);
+			n++;
+		}
+		else {
+			slow_push(val);
+		}
+	}
+	void push(T&& val) {
+		if(n < cap and not shared) {
+			[[likely]]
+			new (ptr+n) T(std::move(val));
+			n++;
+		}
+		else {
+			slow_push(std::move(val));
+		}
+	}
+
+	/**
+	 * @brief Remove top from the stack
+	 */
+	void pop() {
+		assert(!empty());
+		if(shared) [[unlikely]] own();
+		n--;
+		std::destroy_at(ptr+n);
+	}
+
+	/**
+	 * @brief Remove n from the stack
+	 * @param n
+	 */
+	void popn(size_t k) {
+		for(size_t i=0;i<k;i++) {
+			this->pop();
+		}
+	}
+
+	[[nodiscard]] T top() const {
+		assert(!empty());
+		return ptr[n-1];
+	}
+
+	[[nodiscard]] T& topref() {
+		assert(!empty());
+		if(shared) [[unlikely]] own();
+		return ptr[n-1];
+	}
+
+	[[nodiscard]] T toppop() {
+		assert(!empty());
+		T o = std::move(topref());
+		pop();
+		return o;
+	}
+
+	size_t size() const {
+		return n;
+	}
+
+	bool empty() const {
+		return n == 0;
+	}
+
+	std::string string() const {
+		return str(std::vector<T>(begin(), end()));
+	}
+
+	/**
+	 * @brief These are for iterating through the stack from bottom to top. The non-const versions
+	 * 		  allow modification, so they make sure we aren't sharing first.
+	 */
+	T* begin() {
+		if(shared) own();
+		return ptr;
+	}
+	T* end() {
+		return begin()+n;
+	}
+	const T* begin() const { return ptr; }
+	const T* end()   const { return ptr+n; }
+};
+
+template<typename T, size_t N>
+std::string str(const SmallStack<T,N>& a ){
+	return a.string();
+}
@@ -108,8 +108,8 @@ public:
 		add("head(%s)",      +[](S s)      -> S { return (s.empty() ? S("") : S(1,s.at(0))); });
 
 	    // concatenate strings pair(wx,yz) -> wxyz
-		add("pair(%s,%s)",   +[](S a, S b) -> S { 
-			if(a.length() + b.length() > MAX_LENGTH) throw VMSRuntimeError(); // caught inside VirtualMachineState::run
+		add("pair(%s,%s)",   +[](S a, S b) -> std::optional<S> { 
+			if(a.length() + b.length() > MAX_LENGTH) return std::nullopt; // an error, handled inside VirtualMachineState::run
 			else                     				 return a+b; 
 		});
 
@@ -159,8 +159,11 @@ public:
  * 
  * The functions for computing the head of a string is defined similarly. The "pair(%s,%s)" function is meant to concatenate strings
  * but it actually needs to do a little checking because otherwise it's very easy to write programs which create exponentially
- * long strings. So this function checks if its two argument lengths are above a global variable MAX_LENGTH and if so it throws a
- * VMSRuntimeError (VirtualMachineState error) which is caught and handled internally in Fleet. (Note that in the actual Model code, 
+ * long strings. So this function checks if its two argument lengths are above a global variable MAX_LENGTH and if so it signals
+ * an error by returning an empty std::optional, which is handled internally in Fleet (the program's output is the error value). This
+ * is why its return type is std::optional<S>; in the grammar, pair still returns an S. Functions can also throw a VMSRuntimeError, 
+ * which is handled the same way but is much slower, and primitives that work on the VirtualMachineState directly can set its 
+ * status to vmstatus_t::ERROR. (Note that in the actual Model code, 
  * there is a more complex version of pair which is a bit faster, as it modifies strings stored in the VirtualMachineState stack rather
  * than passing them around, as here). 
  *
@@ -445,11 +448,14 @@ public:
 		app.add_option("--tree",           FleetArgs::tree_path, "Write the tree here");
 
 		app.add_option("--omp-threads",    FleetArgs::omp_threads, "How many threads to run with OMP");
+		app.add_option("--vm-samples",     FleetArgs::vm_samples, "If nonzero, stochastic hypotheses are called with this many forward samples instead of enumerating");
 		
 		app.add_option("--header",         FleetArgs::print_header, "Set to 0 to not print header");
 				
 		app.add_flag("--top-print-best",   FleetArgs::top_print_best, "Should all tops defaultly print their best?");
 		app.add_flag("--print-proposals",  FleetArgs::print_proposals, "Should we print out proposals?");
+		app.add_flag("--batch-likelihood", FleetArgs::batch_likelihood, "Should deterministic hypotheses run their likelihood's inputs in one batch?");
+		app.add_flag("--incremental-likelihood", FleetArgs::incremental_likelihood, "Should deterministic hypotheses only recompute the likelihood of data that a proposal could change?");
 		
 //		app.add_flag(  "-q,--quiet",    quiet, "Don't print very much and do so on one line");
 //		app.add_flag(  "-C,--checkpoint",   checkpoint, "Checkpoint every this many steps");
@@ -584,6 +590,17 @@ public:
 				COUT "# Warning: " TAB FleetStatistics::depth_exceptions TAB " grammar depth exceptions." ENDL;
 			}
 			
+			if(FleetStatistics::subtree_cache_hits + FleetStatistics::subtree_cache_misses > 0) {
+				const double lookups = FleetStatistics::subtree_cache_hits + FleetStatistics::subtree_cache_misses;
+				COUT "# Subtree cache hit rate:" TAB FleetStatistics::subtree_cache_hits/lookups TAB "of" TAB lookups TAB "lookups" ENDL;
+				COUT "# Subtree cache size:" TAB FleetStatistics::subtree_cache_entries TAB "entries" TAB FleetStatistics::subtree_cache_bytes/1e6 TAB "MB" ENDL;
+			}
+			
+			if(FleetStatistics::node_allocations > 0) {
+				// (each thread adds its counts in every PoolAllocator::FLUSH allocations, so these are a little behind)
+				COUT "# Node allocations:" TAB FleetStatistics::node_allocations TAB "reused:" TAB double(FleetStatistics::node_allocation_reuses)/FleetStatistics::node_allocations TAB "pooled:" TAB FleetStatistics::node_pool_bytes/1e6 TAB "MB" ENDL;
+			}
+			
 			COUT "# Total posterior calls:" TAB FleetStatistics::posterior_calls ENDL;
 			COUT "# Millions of VM ops per second:" TAB (FleetStatistics::vm_ops/1000000)/elapsed_seconds ENDL;
 			
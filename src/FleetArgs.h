@@ -67,4 +67,16 @@ namespace FleetArgs {
 	// The max number of nodes allowed ina LOTHypothesis
 	size_t MAX_NODES = 64; // how many nodes are allowed in hypotheses?
 	
+	// If this is not zero, StochasticLOTHypothesis::call approximates the output distribution with 
+	// this many forward samples instead of enumerating execution paths
+	size_t vm_samples = 0; 
+	
+	// If true, DeterministicLOTHypothesis::compute_likelihood runs the program on all of the data's 
+	// inputs at once (see BatchVirtualMachineState) when it can 
+	bool batch_likelihood = false; 
+	
+	// If true, DeterministicLOTHypothesis keeps the likelihood of each data point, and after a proposal changes one 
+	// subtree, only recomputes the data points where that subtree's value changed
+	bool incremental_likelihood = false; 
+	
 }
@@ -0,0 +1,292 @@
+#pragma once
+
+#include <vector>
+#include <string>
+#include <cstdint>
+#include <type_traits>
+
+#include "Miscellaneous.h"
+#include "Rule.h"
+#include "Program.h"
+#include "Node.h"
+#include "Builtins.h"
+
+/**
+ * @class FlatTree
+ * @author Steven Piantadosi
+ * @date 18/10/26
+ * @file FlatTree.h
+ * @brief A compact representation of the same trees as Node: one contiguous array of entries, in preorder, where each
+ * 		  entry stores its rule and the size of the subtree below it (including itself). Since entries are trivially
+ * 		  copyable, copying a FlatTree is a single allocation and a memcpy (instead of one allocation per Node), and
+ * 		  comparing or hashing is a linear scan. The children of entry i start at i+1 and each next child starts
+ * 		  where the previous one's subtree ends. Trees convert to and from Node (including null rules), and
+ * 		  Grammar::log_probability and Proposals::regenerate have FlatTree versions.
+ * 		  NOTE: hash() is not the same value as Node::hash, although equal trees always have equal hashes.
+ */
+class FlatTree {
+public:
+
+	struct Entry {
+		const Rule* rule;
+		double      lp;
+		uint32_t    size; // how many entries are in the subtree starting here (including this one)?
+		bool        can_resample;
+
+		bool operator==(const Entry& e) const {
+			return size == e.size and *rule == *e.rule;
+		}
+	};
+	static_assert(std::is_trivially_copyable<Entry>::value, "FlatTree::Entry must be trivially copyable so that copies are memcpys");
+
+protected:
+	std::vector<Entry> entries;
+
+	/**
+	 * @brief Append n and everything below it, in preorder
+	 * @param n
+	 */
+	void append(const Node& n) {
+		const size_t i = entries.size();
+		entries.push_back(Entry{n.rule, n.lp, 0, n.can_resample});
+		for(const auto& c : n.get_children()) {
+			append(c);
+		}
+		entries[i].size = entries.size()-i;
+	}
+
+public:
+
+	FlatTree() {}
+
+	FlatTree(const Node& n) {
+		append(n);
+	}
+
+	/**
+	 * @brief Convert the subtree starting at entry i back into a Node
+	 * @param i
+	 * @return
+	 */
+	Node to_node(size_t i=0) const {
+		assert(i < entries.size());
+		const Entry& e = entries[i];
+		Node n(e.rule, e.lp, e.can_resample);
+		size_t j = i+1;
+		for(size_t k=0;k<e.rule->N;k++) {
+			n.set_child(k, to_node(j));
+			j += entries[j].size;
+		}
+		return n;
+	}
+
+	/**
+	 * @brief How many entries do we have (including null ones)?
+	 * @return
+	 */
+	size_t size() const {
+		return entries.size();
+	}
+
+	bool empty() const {
+		return entries.empty();
+	}
+
+	const Entry& operator[](size_t i) const {
+		return entries[i];
+	}
+
+	const Entry* begin() const { return entries.data(); }
+	const Entry* end()   const { return entries.data()+entries.size(); }
+
+	/**
+	 * @brief Count the non-null entries (the same as Node::count)
+	 * @return
+	 */
+	size_t count() const {
+		size_t n = 0;
+		for(const auto& e : entries) {
+			n += (e.rule != NullRule);
+		}
+		return n;
+	}
+
+	nonterminal_t nt(size_t i=0) const {
+		return entries[i].rule->nt;
+	}
+
+	/**
+	 * @brief The index of the k'th child of entry i
+	 * @param i
+	 * @param k
+	 * @return
+	 */
+	size_t child(size_t i, size_t k) const {
+		assert(k < entries[i].rule->N);
+		size_t j = i+1;
+		for(;k>0;k--) {
+			j += entries[j].size;
+		}
+		return j;
+	}
+
+	/**
+	 * @brief A copy of the subtree starting at entry i
+	 * @param i
+	 * @return
+	 */
+	FlatTree subtree(size_t i) const {
+		FlatTree out;
+		out.entries.assign(entries.begin()+i, entries.begin()+i+entries[i].size);
+		return out;
+	}
+
+	/**
+	 * @brief Replace the subtree starting at entry i with t. Every entry before i whose subtree contains i is one of
+	 * 		  i's ancestors, so those are the sizes that change.
+	 * @param i
+	 * @param t
+	 */
+	void replace(size_t i, const FlatTree& t) {
+		assert(i < entries.size() and not t.empty());
+
+		const size_t old = entries[i].size;
+		for(size_t j=0;j<i;j++) {
+			if(j + entries[j].size > i) {
+				entries[j].size = entries[j].size - old + t.size();
+			}
+		}
+
+		if(t.size() > old) {
+			entries.insert(entries.begin()+i+old, t.size()-old, Entry{});
+		}
+		else {
+			entries.erase(entries.begin()+i+t.size(), entries.begin()+i+old);
+		}
+		std::copy(t.entries.begin(), t.entries.end(), entries.begin()+i);
+	}
+
+	bool operator==(const FlatTree& t) const {
+		return entries == t.entries;
+	}
+
+	size_t hash() const {
+		size_t ret = entries.size();
+		for(const auto& e : entries) {
+			hash_combine(ret, e.rule->get_hash(), e.size);
+		}
+		return ret;
+	}
+
+	std::string string(bool usedot=true) const {
+		return to_node().string(usedot);
+	}
+
+	std::string parseable() const {
+		return to_node().parseable();
+	}
+
+	/********************************************************
+	 * Operaitons for running programs
+	 ********************************************************/
+
+	/**
+	 * @brief Convert the subtree starting at entry i into a program, with exactly the layout that Node::linearize uses
+	 * 		  (including short-circuiting and superinstructions), so the two can be used interchangeably.
+	 * @param program
+	 * @param i
+	 * @return The size of what was pushed onto program
+	 */
+	template<typename VirtualMachineState_t, typename Grammar_t>
+	int linearize(Program<VirtualMachineState_t> &program, size_t i=0) const {
+		const Rule* rule = entries[i].rule;
+		assert(rule != NullRule && "*** Cannot linearize if there is a null rule");
+
+		if( rule->is_a(Op::If) ) {
+			[[unlikely]]
+			assert(rule->N == 3 && "BuiltinOp::op_IF require three arguments");
+
+			int ysize = linearize<VirtualMachineState_t,Grammar_t>(program, child(i,2));
+			program.push(Builtins::Jmp<Grammar_t>.makeInstruction(ysize));
+			int xsize = linearize<VirtualMachineState_t,Grammar_t>(program, child(i,1))+1; // +1 to skip over the JMP too
+			program.push(rule->makeInstruction(xsize));
+			int boolsize = linearize<VirtualMachineState_t,Grammar_t>(program, child(i,0));
+
+			return ysize + xsize + boolsize + 1;
+		}
+		else if( rule->is_a(Op::And) or rule->is_a(Op::Or)) {
+			[[unlikely]]
+			assert(rule->N == 2 && "BuiltinOp::op_AND and BuiltinOp::op_OR require two arguments");
+
+			int ysize = linearize<VirtualMachineState_t,Grammar_t>(program, child(i,1));
+			program.push(rule->makeInstruction(ysize));
+			return linearize<VirtualMachineState_t,Grammar_t>(program, child(i,0))+ysize+1;
+		}
+		else if(not rule->superinstructions.empty()) {
+
+			// find the longest superinstruction that matches me and my last children
+			const Superinstruction* best = nullptr;
+			for(const auto& s : rule->superinstructions) {
+				size_t j = i;
+				size_t k = 1;
+				for(;k<s.rules.size() and entries[j].rule->N > 0;k++) {
+					j = child(j, entries[j].rule->N-1);
+					if(entries[j].rule != s.rules[k]) break;
+				}
+				if(k == s.rules.size() and (best == nullptr or s.rules.size() > best->rules.size()))
+					best = &s;
+			}
+
+			if(best == nullptr) {
+				return linearize_children<VirtualMachineState_t,Grammar_t>(program, i);
+			}
+
+			std::vector<size_t> chain{i};
+			while(chain.size() < best->rules.size()) {
+				chain.push_back(child(chain.back(), entries[chain.back()].rule->N-1));
+			}
+
+			program.push(Instruction(best->f, 0, Op::Standard));
+			int mysize = 1;
+
+			// the bottom of the chain runs all of its children, and the others run all but the last
+			for(int k=entries[chain.back()].rule->N-1;k>=0;k--) {
+				mysize += linearize<VirtualMachineState_t,Grammar_t>(program, child(chain.back(),k));
+			}
+			for(int c=chain.size()-2;c>=0;c--) {
+				for(int k=entries[chain[c]].rule->N-2;k>=0;k--) {
+					mysize += linearize<VirtualMachineState_t,Grammar_t>(program, child(chain[c],k));
+				}
+			}
+			return mysize;
+		}
+		else {
+			[[likely]]
+			return linearize_children<VirtualMachineState_t,Grammar_t>(program, i);
+		}
+	}
+
+	template<typename VirtualMachineState_t, typename Grammar_t>
+	int linearize_children(Program<VirtualMachineState_t> &program, size_t i) const {
+		const Rule* rule = entries[i].rule;
+		program.push(rule->makeInstruction());
+
+		int mysize = 1;
+		for(int k=rule->N-1;k>=0;k--) {
+			mysize += linearize<VirtualMachineState_t,Grammar_t>(program, child(i,k));
+		}
+		return mysize;
+	}
+};
+
+std::ostream& operator<<(std::ostream& o, const FlatTree& t) {
+	o << t.string();
+	return o;
+}
+
+template<>
+struct std::hash<FlatTree> {
+	std::size_t operator()(const FlatTree& t) const {
+		return t.hash();
+	}
+};
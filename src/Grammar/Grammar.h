@@ -3,14 +3,27 @@
 #include <tuple>
 #include <array>
 #include <exception>
+#include <list>
+#include <map>
+#include <limits>
+#include <charconv>
+#include <string_view>
+#include <unordered_map>
+#include <atomic>
+#include <mutex>
 
 #include "IO.h"
 #include "Errors.h"
 #include "Node.h"
+#include "FlatTree.h"
+#include "SharedNode.h"
 #include "Random.h"
 #include "Nonterminal.h"
 #include "VirtualMachineState.h"
 #include "VirtualMachinePool.h"
+#include "BatchVirtualMachineState.h"
+#include "Closure.h"
+#include "SubtreeCache.h"
 #include "Builtins.h"
 #include "Functional.h"
 
@@ -61,6 +74,9 @@ public:
 	// This is the function type
 	using FT = typename VirtualMachineState_t::FT; 
 	
+	// This runs a program on many inputs at once (see DeterministicLOTHypothesis::call_batch)
+	using BatchVirtualMachineState_t = BatchVirtualMachineState<input_t, output_t, GRAMMAR_TYPES...>;
+	
 	// How many times will we silently ignore a DepthException
 	// before tossing an assert error
 	static const size_t GENERATE_DEPTH_EXCEPTION_RETRIES = 1000; 
@@ -74,8 +90,44 @@ public:
 	std::vector<Rule>        rules[N_NTs];
 	std::array<double,N_NTs> Z; // keep the normalizer handy for each nonterminal (not log space)
 	
+	// each rule's Rule::fbatch, indexed by Rule::index (which is what an Instruction stores)
+	std::vector<void*>       batch_functions;
+	
 	size_t GRAMMAR_MAX_DEPTH = 64;
 	
+	// how many superinstructions have we added? (see add_superinstruction)
+	size_t nsuperinstructions = 0;
+	
+	// format_index[nt] maps each format of a rule of type nt to that rule (or to nullptr if more than one rule has that
+	// format), so that get_rule and from_parseable don't have to scan the rules. This is rebuilt by reindex_rules. 
+	struct FormatHash {
+		using is_transparent = void;
+		size_t operator()(std::string_view s) const { return std::hash<std::string_view>{}(s); }
+	};
+	std::array<std::unordered_map<std::string,Rule*,FormatHash,std::equal_to<>>,N_NTs> format_index;
+	
+	// This changes every time any rule's probability (or Z) changes, so that Nodes can tell whether the log_probability
+	// they cached was computed with this grammar as it is now (see Node::get_cached_log_probability). 
+	size_t stamp = new_stamp();
+	
+	// cumulative_p[nt][i] is the total probability of rules[nt][0..i], so that sample_rule can binary search it
+	// (this is rebuilt by probabilities_changed)
+	std::array<std::vector<double>,N_NTs> cumulative_p;
+	
+	// depth_failure_p[nt][d] is the probability that generating nt at depth d would go past GRAMMAR_MAX_DEPTH, and 
+	// truncated_cumulative_p[nt][d] is like cumulative_p, but with each rule weighted by the probability that all of 
+	// its children finish in time, so that generate can sample trees that fit directly. It is empty when those weights 
+	// are exactly the rules' p (as happens far above the bound), and then sample_rule is used. These are built for 
+	// truncation_depth, which is GRAMMAR_MAX_DEPTH unless that was changed without set_max_depth. 
+	// Building these takes time in the number of rules times GRAMMAR_MAX_DEPTH, so probabilities_changed only marks 
+	// them dirty, and they are rebuilt (under truncation_mutex, since generate may be called from many threads) the 
+	// next time something uses them (see update_truncation_tables). 
+	mutable std::array<std::vector<double>,N_NTs> depth_failure_p;
+	mutable std::array<std::vector<std::vector<double>>,N_NTs> truncated_cumulative_p;
+	mutable size_t truncation_depth = 0;
+	mutable std::atomic<bool> truncation_dirty = true;
+	mutable std::mutex truncation_mutex;
+	
 	// This function converts a type (passed as a template parameter) into a 
 	// size_t index for which one it in in GRAMMAR_TYPES. 
 	// This is used so that a Rule doesn't need type subclasses/templates, it can
@@ -87,6 +139,117 @@ public:
 		return (nonterminal_t)TypeIndex<T, std::tuple<GRAMMAR_TYPES...>>::value;
 	}
 	
+	/**
+	 * @brief A stamp that no grammar has used before (these are shared across every kind of grammar, since a Node
+	 * 		  just stores a number)
+	 * @return 
+	 */
+	static size_t new_stamp() {
+		static std::atomic<size_t> next(1);
+		return next++;
+	}
+	
+	/**
+	 * @brief This must be called whenever a rule's probability or Z is changed directly, so that Nodes don't use log 
+	 * 		  probabilities they cached with the old values, and so that sample_rule's and generate's tables are rebuilt
+	 * 		  (generate's lazily, see update_truncation_tables). 
+	 */
+	void probabilities_changed() {
+		stamp = new_stamp();
+		
+		for(size_t nt=0;nt<N_NTs;nt++) {
+			cumulative_p[nt].resize(rules[nt].size());
+			double tot = 0.0;
+			for(size_t i=0;i<rules[nt].size();i++) {
+				const double p = rules[nt][i].p;
+				if(not std::isnan(p)) tot += p; // NaN is treated as zero, as in sample
+				cumulative_p[nt][i] = tot;
+			}
+		}
+		
+		truncation_dirty = true;
+	}
+	
+	/**
+	 * @brief Rebuild depth_failure_p and truncated_cumulative_p if they are out of date. This is called by everything
+	 * 		  that uses them, so that e.g. adding many rules one at a time only builds them once. 
+	 */
+	void update_truncation_tables() const {
+		if(truncation_dirty) {
+			std::lock_guard guard(truncation_mutex);
+			if(truncation_dirty) { // another thread may have built them while we waited
+				build_truncation_tables();
+				truncation_dirty = false;
+			}
+		}
+	}
+	
+	/**
+	 * @brief Compute depth_failure_p and truncated_cumulative_p for GRAMMAR_MAX_DEPTH, going up from the bound. 
+	 * 		  We store the probability of failing rather than finishing so that it stays accurate when it is tiny.
+	 */
+	void build_truncation_tables() const {
+		const size_t maxd = GRAMMAR_MAX_DEPTH;
+		for(size_t nt=0;nt<N_NTs;nt++) {
+			depth_failure_p[nt].assign(maxd+1, 0.0);
+			depth_failure_p[nt][maxd] = 1.0; // a node at the bound always fails
+			truncated_cumulative_p[nt].assign(maxd, {});
+		}
+		
+		for(int d=maxd-1;d>=0;d--) {
+			for(size_t nt=0;nt<N_NTs;nt++) {
+				std::vector<double> c(rules[nt].size());
+				double tot = 0.0;  // total weight 
+				double fail = 0.0; // total probability of failing
+				bool changed = false;
+				for(size_t i=0;i<rules[nt].size();i++) {
+					const Rule& r = rules[nt][i];
+					const double p = std::isnan(r.p) ? 0.0 : r.p;
+					
+					double finish = 1.0; // probability all of the children finish
+					for(size_t k=0;k<r.N;k++) {
+						finish *= 1.0 - depth_failure_p[r.type(k)][d+1];
+					}
+					
+					const double w = p*finish;
+					changed = changed or (w != p);
+					tot += w;
+					fail += p*(1.0-finish);
+					c[i] = tot;
+				}
+				
+				depth_failure_p[nt][d] = (Z[nt] > 0.0 ? std::min(1.0, fail/Z[nt]) : 1.0);
+				if(changed) {
+					truncated_cumulative_p[nt][d] = std::move(c);
+				}
+			}
+		}
+		
+		truncation_depth = maxd;
+	}
+	
+	/**
+	 * @brief Set GRAMMAR_MAX_DEPTH (and rebuild the tables that let generate sample trees that fit under it)
+	 * @param d
+	 */
+	void set_max_depth(size_t d) {
+		GRAMMAR_MAX_DEPTH = d;
+		truncation_dirty = true;
+	}
+	
+	/**
+	 * @brief The probability that generating nt at depth finishes without going past GRAMMAR_MAX_DEPTH
+	 * @param nt
+	 * @param depth
+	 * @return 
+	 */
+	double termination_probability(const nonterminal_t nt, size_t depth=0) const {
+		update_truncation_tables();
+		assert(truncation_depth == GRAMMAR_MAX_DEPTH && "*** Use set_max_depth to change GRAMMAR_MAX_DEPTH");
+		if(depth >= truncation_depth) return 0.0;
+		return 1.0 - depth_failure_p[nt][depth];
+	}
+	
 	Grammar() {
 		for(size_t i=0;i<N_NTs;i++) {
 			Z[i] = 0.0;
@@ -213,6 +376,7 @@ public:
 		Z[r->nt] -= r->p;
 		r->p = newp;
 		Z[r->nt] += r->p;
+		probabilities_changed();
 	}
 	
 	size_t count_terminals(nonterminal_t nt) const {
@@ -290,16 +454,46 @@ public:
 	 * @param f
 	 * @param p
 	 * @param o
+	 * @param fbatch - optionally, a version of f for BatchVirtualMachineState
+	 * @param fclosure - optionally, how to compile this rule into a closure (see Closure.h)
 	 */		
 	template<typename T, typename... args> 
-	void add_vms(std::string fmt, FT* f, double p=1.0, Op o=Op::Standard, int a=0) {
+	void add_vms(std::string fmt, FT* f, double p=1.0, Op o=Op::Standard, int a=0, 
+				 typename BatchVirtualMachineState_t::FT* fbatch=nullptr, ClosureCompiler* fclosure=nullptr) {
 		assert(f != nullptr && "*** If you're passing a null f to add_vms, you've really screwed up.");
+		assert(nsuperinstructions == 0 && "*** Superinstructions must be added after all of the rules (since adding a rule moves the others)");
 		
 		nonterminal_t Tnt = this->nt<T>();
 		Rule r(Tnt, (void*)f, fmt, {nt<args>()...}, p, o, a);
+		r.fbatch = (void*)fbatch;
+		r.fclosure = (void*)fclosure;
 		Z[Tnt] += r.p; // keep track of the total probability
 		auto pos = std::lower_bound( rules[Tnt].begin(), rules[Tnt].end(), r);
 		rules[Tnt].insert( pos, r ); // put this before	
+		
+		reindex_rules(); // since this moved everything after it 
+		probabilities_changed();
+	}
+	
+	/**
+	 * @brief Set each rule's index to where it is in the order of get_rule_indexer. This is what goes into 
+	 * 		  each Instruction (so that RuntimeCounter can keep track of rules), so it must be called whenever rules change. 
+	 * 		  This also rebuilds batch_functions and format_index (since adding a rule moves the others). 
+	 */	
+	void reindex_rules() {
+		batch_functions.clear();
+		size_t idx = 0;
+		for(size_t nt=0;nt<N_NTs;nt++) {
+			format_index[nt].clear();
+			for(auto& r : rules[nt]) {
+				assert(idx < Instruction::NO_RULE && "*** Too many rules to fit their index into an Instruction");
+				r.index = idx++;
+				batch_functions.push_back(r.fbatch);
+				
+				auto [it, added] = format_index[nt].emplace(r.format, &r);
+				if(not added) it->second = nullptr; // more than one rule has this format
+			}
+		}
 	}
 	
 	/**
@@ -312,7 +506,7 @@ public:
 	void add(std::string fmt, Primitive<T,args...>& b, double p=1.0, int a=0) {
 		// read f and o from b
 		assert(b.f != nullptr);
-		add_vms<T,args...>(fmt, (FT*)b.f, p, b.op, a);
+		add_vms<T,args...>(fmt, (FT*)b.f, p, b.op, a, nullptr, make_builtin_closure_compiler<input_t,T,args...>(b.op));
 	}
 	
 	/**
@@ -324,11 +518,15 @@ public:
 	 */	
 	template<typename T, typename... args> 
 	void add(std::string fmt,  std::function<T(args...)> f, double p=1.0, Op o=Op::Standard, int a=0) {
+		// A function may return std::optional<R> so that it can signal an error by returning std::nullopt (which is
+		// much faster than throwing a VMSRuntimeError). In the grammar, it returns R. 
+		using R = typename strip_optional<T>::type;
+		
 		// first check that the types are allowed
 		
 		static_assert((not std::is_reference<T>::value) && "*** Primitives cannot return references.");
 		static_assert((not std::is_reference<args>::value && ...) && "*** Arguments cannot be references.");
-		static_assert(is_in_GRAMMAR_TYPES<T>() , "*** Return type is not in GRAMMAR_TYPES");
+		static_assert(is_in_GRAMMAR_TYPES<R>() , "*** Return type is not in GRAMMAR_TYPES");
 		static_assert((is_in_GRAMMAR_TYPES<args>() && ...),	"*** Argument type is not in GRAMMAR_TYPES");
 		
 		// NOTE: We want something with friendly error messages instead of the above,
@@ -358,29 +556,29 @@ public:
 				assert(vms != nullptr);
 			
 				if constexpr (sizeof...(args) ==  0){	
-					vms->push( f() );
+					push_result(vms, f());
 				}
 				else if constexpr (sizeof...(args) ==  1) {
 					auto a0 = vms->template getpop_nth<0,args...>();		
-					vms->push(f(std::move(a0)));
+					push_result(vms, f(std::move(a0)));
 				}
 				else if constexpr (sizeof...(args) ==  2) {
 					auto a1 = vms->template getpop_nth<1,args...>();	
 					auto a0 = vms->template getpop_nth<0,args...>();		
-					vms->push(f(std::move(a0), std::move(a1)));
+					push_result(vms, f(std::move(a0), std::move(a1)));
 				}
 				else if constexpr (sizeof...(args) ==  3) {
 					auto a2 = vms->template getpop_nth<2,args...>();	
 					auto a1 = vms->template getpop_nth<1,args...>();	
 					auto a0 = vms->template getpop_nth<0,args...>();	
-					vms->push(f(std::move(a0), std::move(a1), std::move(a2)));
+					push_result(vms, f(std::move(a0), std::move(a1), std::move(a2)));
 				}
 				else if constexpr (sizeof...(args) ==  4) {
 					auto a3 = vms->template getpop_nth<3,args...>();	
 					auto a2 = vms->template getpop_nth<2,args...>();	
 					auto a1 = vms->template getpop_nth<1,args...>();	
 					auto a0 = vms->template getpop_nth<0,args...>();		
-					vms->push(f(std::move(a0), std::move(a1), std::move(a2), std::move(a3)));
+					push_result(vms, f(std::move(a0), std::move(a1), std::move(a2), std::move(a3)));
 				}
 				else if constexpr (sizeof...(args) ==  5) {
 					auto a4 = vms->template getpop_nth<4,args...>();	
@@ -388,7 +586,7 @@ public:
 					auto a2 = vms->template getpop_nth<2,args...>();	
 					auto a1 = vms->template getpop_nth<1,args...>();	
 					auto a0 = vms->template getpop_nth<0,args...>();		
-					vms->push(f(std::move(a0), std::move(a1), std::move(a2), std::move(a3), std::move(a4)));
+					push_result(vms, f(std::move(a0), std::move(a1), std::move(a2), std::move(a3), std::move(a4)));
 				}
 				else if constexpr (sizeof...(args) ==  6) {
 					auto a5 = vms->template getpop_nth<5,args...>();	
@@ -397,7 +595,7 @@ public:
 					auto a2 = vms->template getpop_nth<2,args...>();	
 					auto a1 = vms->template getpop_nth<1,args...>();	
 					auto a0 = vms->template getpop_nth<0,args...>();		
-					vms->push(f(std::move(a0), std::move(a1), std::move(a2), std::move(a3), std::move(a4), std::move(a5)));
+					push_result(vms, f(std::move(a0), std::move(a1), std::move(a2), std::move(a3), std::move(a4), std::move(a5)));
 				}
 				else {
 					print("*** Error -- too many arguments for a function. Must be updated in Grammar.h ", sizeof...(args) );
@@ -405,8 +603,73 @@ public:
 					assert(false);
 				}
 			});
+		
+		// and one that runs on columns, for BatchVirtualMachineState (which needs to make columns of R)
+		typename BatchVirtualMachineState_t::FT* fbatch = nullptr; 
+		if constexpr (std::is_default_constructible<R>::value) {
+			fbatch = new typename BatchVirtualMachineState_t::FT([=](BatchVirtualMachineState_t* b, int _a=0) -> void {
+				assert(b != nullptr);
+				batch_apply<T,args...>(b, f, std::index_sequence_for<args...>{});
+			});
+		}
 			
-		add_vms<T,args...>(fmt, fvms, p, o, a);
+		// and how to compile it into a closure
+		auto fclosure = new ClosureCompiler([=](const std::vector<AnyClosure>& c) -> AnyClosure {
+			return make_closure<input_t,T,args...>(f, c, std::index_sequence_for<args...>{});
+		});
+			
+		add_vms<R,args...>(fmt, fvms, p, o, a, fbatch, fclosure);
+	}
+	
+	/**
+	 * @brief Run f on every lane of b: this pops a column for each argument, and pushes a column of outputs. Lanes 
+	 * 		  where f throws VMSRuntimeError or returns an empty std::optional get an error.
+	 * @param b
+	 * @param f
+	 */	
+	template<typename T, typename... args, size_t... I>
+	static void batch_apply(BatchVirtualMachineState_t* b, const std::function<T(args...)>& f, std::index_sequence<I...>) {
+		using R = typename strip_optional<T>::type;
+		constexpr size_t N = sizeof...(args);
+		
+		// pop the arguments in reverse order (the last one is on top), just like the calling convention above
+		std::tuple<typename BatchVirtualMachineState_t::template column_t<args>...> cols;
+		((std::get<N-1-I>(cols) = b->template getpop<std::tuple_element_t<N-1-I, std::tuple<args...>>>()), ...);
+		
+		const size_t n = b->size();
+		typename BatchVirtualMachineState_t::template column_t<R> out(n);
+		for(size_t k=0;k<n;k++) {
+			try {
+				if constexpr (is_specialization<T, std::optional>::value) {
+					auto o = f(std::move(std::get<I>(cols)[k])...);
+					if(o.has_value()) out[k] = std::move(*o);
+					else              b->fail(k);
+				}
+				else {
+					out[k] = f(std::move(std::get<I>(cols)[k])...);
+				}
+			} catch(VMSRuntimeError& e) {
+				b->fail(k);
+			}
+		}
+		b->push(std::move(out));
+	}
+	
+	/**
+	 * @brief Push the value that a function returned. If it returns an empty std::optional, this sets vms's status
+	 * 		  to ERROR instead, and VirtualMachineState::run stops just like it would if we had thrown VMSRuntimeError.
+	 * @param vms
+	 * @param out
+	 */	
+	template<typename T>
+	static void push_result(VirtualMachineState_t* vms, T&& out) {
+		if constexpr (is_specialization<std::decay_t<T>, std::optional>::value) {
+			if(out.has_value()) vms->push(std::move(*out));
+			else                vms->status = vmstatus_t::ERROR;
+		}
+		else {
+			vms->push(std::move(out));
+		}
 	}
 
 	/**
@@ -464,6 +727,283 @@ public:
 	void remove_all(nonterminal_t nt) {
 		rules[nt].clear();
 		Z[nt] = 0.0;
+		reindex_rules();
+		probabilities_changed();
+	}
+	
+	/**
+	 * @brief Compile n into a closure that returns a T (see Closure.h), or return nullptr if some rule in n 
+	 * 		  doesn't know how to be compiled (then n has to be run in a VirtualMachineState). 
+	 * @param n
+	 * @return 
+	 */	
+	template<typename T>
+	std::shared_ptr<Closure<input_t,T>> compile_closure(const Node& n) const {
+		assert(n.rule->nt == nt<T>() && "*** Cannot compile a closure of the wrong type");
+		return std::static_pointer_cast<Closure<input_t,T>>(compile_any_closure(n));
+	}
+	
+	AnyClosure compile_any_closure(const Node& n) const {
+		if(n.rule->fclosure == nullptr) return nullptr; // this also catches NullRule
+		
+		std::vector<AnyClosure> c;
+		c.reserve(n.nchildren());
+		for(const auto& ch : n.get_children()) {
+			auto cc = compile_any_closure(ch);
+			if(cc == nullptr) return nullptr;
+			c.push_back(std::move(cc));
+		}
+		
+		return (*reinterpret_cast<ClosureCompiler*>(n.rule->fclosure))(c);
+	}
+	
+	/**
+	 * @brief Linearize n into program with constant folding: each largest subtree that doesn't depend on the input (it 
+	 * 		  has no X and every rule in it can be compiled into a closure, so it is deterministic and doesn't recurse) 
+	 * 		  is run once here and replaced with a single instruction that pushes its value. So e.g. pair('a','b') is not 
+	 * 		  recomputed on every input and in every recursive call. Subtrees that give an error (or throw anything) are 
+	 * 		  left alone, so that they still do when run. Nothing is folded inside an operand that might not be run (the 
+	 * 		  branches of If and the second operand of And and Or), since that could run code the program never would. 
+	 * 		  The functions that push the values are kept in program (its constant pool). This is only done when 
+	 * 		  VirtualMachineControl::FOLD_CONSTANTS, since it changes how many instructions programs run.
+	 * 		  NOTE: This assumes that the functions given to add are pure (they only depend on their arguments). 
+	 * @param n
+	 * @param program
+	 */	
+	template<typename VirtualMachineState_t>
+	void linearize_folded(const Node& n, Program<VirtualMachineState_t>& program) const {
+		
+		// most of the time there is nothing to fold, so check first since folding requires copying n
+		bool found = false;
+		auto find = [&](const Node& parent, size_t i) { found = true; };
+		if(fold_constants(n, find) and n.nchildren() > 0) found = true;
+		
+		if(not found) {
+			n.template linearize<VirtualMachineState_t, this_t>(program);
+			return;
+		}
+		
+		std::list<Rule> constant_rules; // the rules in the folded tree, which only need to live until we linearize
+		
+		auto fold = [&](const Node& c) -> std::optional<Node> {
+			auto f = make_constant<VirtualMachineState_t>(c.rule->nt, compile_any_closure(c), std::make_index_sequence<N_NTs>{});
+			if(f == nullptr) return {}; // it gave an error
+			
+			program.add_constant(f);
+			constant_rules.emplace_back(c.rule->nt, f.get(), "<constant>", std::initializer_list<nonterminal_t>{}, 0.0);
+			return Node(&constant_rules.back());
+		};
+		
+		Node folded = n; 
+		auto replace = [&](Node& parent, size_t i) { 
+			if(auto c = fold(parent.child(i))) parent.set_child(i, std::move(*c));
+		};
+		if(fold_constants(folded, replace) and folded.nchildren() > 0) {
+			if(auto c = fold(folded)) folded = std::move(*c);
+		}
+		
+		folded.template linearize<VirtualMachineState_t, this_t>(program);
+	}
+	
+	/**
+	 * @brief Find the subtrees of n that constant folding can replace. This returns whether all of n could be folded, 
+	 * 		  and otherwise calls f(parent, i) for each child i that can be, but only if it has children (since then 
+	 * 		  folding saves instructions). 
+	 * @param n
+	 * @param f
+	 * @return 
+	 */	
+	template<typename N, typename F>
+	bool fold_constants(N& n, F& f) const {
+		bool closed = (n.rule->fclosure != nullptr) and (not n.rule->is_a(Op::X));
+		
+		NoFold nofold; 
+		std::vector<bool> child_closed(n.nchildren());
+		for(size_t i=0;i<n.nchildren();i++) {
+			child_closed[i] = may_skip(n.rule, i) ? fold_constants(n.child(i), nofold) : fold_constants(n.child(i), f);
+			closed = closed and child_closed[i];
+		}
+		
+		if(not closed) {
+			for(size_t i=0;i<n.nchildren();i++) {
+				if(child_closed[i] and n.child(i).nchildren() > 0 and not may_skip(n.rule, i)) f(n, i);
+			}
+		}
+		return closed;
+	}
+	
+	// what fold_constants calls inside operands that may be skipped (so nothing there is folded)
+	struct NoFold { 
+		void operator()(const auto& parent, size_t i) const {}
+	};
+	
+	/**
+	 * @brief Might a program skip running the i'th child of a node with rule r? (The branches of If and the second 
+	 * 		  operand of And and Or, which short-circuit)
+	 * @param r
+	 * @param i
+	 * @return 
+	 */	
+	static bool may_skip(const Rule* r, size_t i) {
+		return (r->is_a(Op::If) and i > 0) or ((r->is_a(Op::And) or r->is_a(Op::Or)) and i == 1);
+	}
+	
+	/**
+	 * @brief Run the closure c, which returns the t'th type, and return a function that pushes its value for
+	 * 		  VirtualMachineState_t (or nullptr if it gives an error). 
+	 * @param t
+	 * @param c
+	 * @return 
+	 */	
+	template<typename VirtualMachineState_t, size_t... I>
+	std::shared_ptr<void> make_constant(nonterminal_t t, const AnyClosure& c, std::index_sequence<I...>) const {
+		std::shared_ptr<void> out;
+		(void)(((I == t) and (out = make_constant<VirtualMachineState_t, std::tuple_element_t<I,TypeTuple>>(c), true)) or ...);
+		return out;
+	}
+	
+	template<typename VirtualMachineState_t, typename T>
+	static std::shared_ptr<void> make_constant(const AnyClosure& c) {
+		if constexpr (std::is_default_constructible<input_t>::value and std::is_copy_constructible<T>::value) {
+			assert(c != nullptr);
+			try { 
+				T v = (*std::static_pointer_cast<Closure<input_t,T>>(c))(input_t{}); // the input is never used
+				return std::make_shared<typename VirtualMachineState_t::FT>([v](VirtualMachineState_t* vms, int _a=0) -> void {
+					vms->template push<T>(T(v)); // push a copy
+				});
+			} catch(...) {
+				// leave it to give the error (or throw) when run
+			}
+		}
+		return nullptr;
+	}
+	
+	/**
+	 * @brief Linearize n into program, looking up its deterministic subtrees in a SubtreeCache instead of always running 
+	 * 		  them (see VirtualMachineControl::SUBTREE_CACHE). A subtree is cached if it uses the input (if not, constant 
+	 * 		  folding handles it), everything in it is deterministic (X, the boolean builtins, and rules given to add, which
+	 * 		  are assumed to be pure), it has at least SUBTREE_CACHE_MIN_NODES nodes, and it is at most half 
+	 * 		  the size of the nearest cached subtree above it, so that a program only makes a few lookups. Each is replaced 
+	 * 		  with an instruction that pushes the cached value if there is one, and otherwise runs the subtree's own 
+	 * 		  program (made by calling this on it), followed by an instruction that stores its value. 
+	 * @param n
+	 * @param program
+	 * @param limit - the size of the nearest cached subtree above n
+	 */	
+	template<typename VirtualMachineState_t>
+	void linearize_cached(const Node& n, Program<VirtualMachineState_t>& program, size_t limit=std::numeric_limits<size_t>::max()) const {
+		
+		std::list<Rule> cache_rules; // the rules in the new tree, which only need to live until we linearize
+		
+		Node cached = n;
+		if(auto c = cache_subtrees(cached, program, cache_rules, limit)) {
+			cached = std::move(*c);
+		}
+		
+		if(VirtualMachineControl::FOLD_CONSTANTS) linearize_folded<VirtualMachineState_t>(cached, program);
+		else                                      cached.template linearize<VirtualMachineState_t, this_t>(program);
+	}
+	
+	/**
+	 * @brief Replace the subtrees of n that linearize_cached caches, returning what to replace n itself with (if anything)
+	 * @param n
+	 * @param program
+	 * @param cache_rules
+	 * @param limit
+	 * @return 
+	 */	
+	template<typename VirtualMachineState_t>
+	std::optional<Node> cache_subtrees(Node& n, Program<VirtualMachineState_t>& program, std::list<Rule>& cache_rules, size_t limit) const {
+		
+		const size_t c = n.count();
+		if(c >= VirtualMachineControl::SUBTREE_CACHE_MIN_NODES and 2*c <= limit and can_cache(n)) {
+			
+			auto sub = std::make_shared<Program<VirtualMachineState_t>>();
+			linearize_cached(n, *sub, c); // n's own subtrees can be cached too
+			
+			// the cache checks that a value was stored for this same subtree (and so this grammar), not just its hash
+			const SharedNode s(n); 
+			
+			auto f = make_cache_lookup<VirtualMachineState_t>(n.rule->nt, s, sub, std::make_index_sequence<N_NTs>{});
+			if(f != nullptr) {
+				program.add_constant(f);
+				cache_rules.emplace_back(n.rule->nt, f.get(), "<cached>", std::initializer_list<nonterminal_t>{}, 0.0);
+				return Node(&cache_rules.back());
+			}
+		}
+		
+		for(size_t i=0;i<n.nchildren();i++) {
+			if(auto r = cache_subtrees(n.child(i), program, cache_rules, limit)) {
+				n.set_child(i, std::move(*r));
+			}
+		}
+		return {};
+	}
+	
+	/**
+	 * @brief Is n deterministic and does it use the input? (Needed for linearize_cached to cache it) Standard rules have to 
+	 * 		  be ones that can be compiled into closures (those given to add), since a rule added with add_vms may make
+	 * 		  random choices, recurse, or depend on more than its arguments. 
+	 * @param n
+	 * @return 
+	 */	
+	static bool can_cache(const Node& n) {
+		bool uses_x = false;
+		for(const auto& m : n) {
+			const Rule* r = m.rule;
+			if(r->is_a(Op::X)) {
+				uses_x = true;
+			}
+			else if(not ((r->is_a(Op::Standard) and r->fclosure != nullptr) or r->is_a(Op::If) or r->is_a(Op::And) or r->is_a(Op::Or) or 
+			             r->is_a(Op::Not) or r->is_a(Op::Implies) or r->is_a(Op::Iff))) {
+				return false;
+			}
+		}
+		return uses_x;
+	}
+	
+	/**
+	 * @brief Make the function for the instruction that looks up subtree s (whose program is sub) whose value is the
+	 * 		  t'th type, or nullptr if we can't cache that type. 
+	 * @param t
+	 * @param s
+	 * @param sub
+	 * @return 
+	 */	
+	template<typename VirtualMachineState_t, size_t... I>
+	static std::shared_ptr<void> make_cache_lookup(nonterminal_t t, const SharedNode& s, std::shared_ptr<Program<VirtualMachineState_t>> sub, std::index_sequence<I...>) {
+		std::shared_ptr<void> out;
+		(void)(((I == t) and (out = make_cache_lookup<VirtualMachineState_t, std::tuple_element_t<I,TypeTuple>>(s, sub), true)) or ...);
+		return out;
+	}
+	
+	template<typename VirtualMachineState_t, typename T>
+	static std::shared_ptr<void> make_cache_lookup(const SharedNode& s, std::shared_ptr<Program<VirtualMachineState_t>> sub) {
+		if constexpr (std::is_default_constructible<T>::value and std::is_copy_constructible<T>::value and 
+					  std::equality_comparable<input_t> and requires(const input_t& x) { std::hash<input_t>{}(x); }) {
+			
+			using Cache_t = SubtreeCache<input_t,T>;
+			static Cache_t cache; // one for each type (and VirtualMachineState_t)
+			
+			// this runs after sub, so its value is on top
+			auto store = std::make_shared<typename VirtualMachineState_t::FT>([s](VirtualMachineState_t* vms, int _a=0) -> void {
+				cache.insert(Cache_t::make_key(s.hash(), vms->xstack.topref()), s, vms->template stack<T>().topref());
+			});
+			
+			return std::make_shared<typename VirtualMachineState_t::FT>([s, sub, store](VirtualMachineState_t* vms, int _a=0) -> void {
+				T v;
+				if(cache.find(Cache_t::make_key(s.hash(), vms->xstack.topref()), s, v)) {
+					vms->template push<T>(std::move(v));
+				}
+				else {
+					vms->program.push(Instruction(store.get(), 0, Op::Standard));
+					vms->program.push(*sub); // NOTE: sub lives as long as we do, which is as long as the program we're in
+				}
+			});
+		}
+		else {
+			return nullptr;
+		}
 	}
 	
 	// ~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~
@@ -521,6 +1061,19 @@ public:
 		return &rules[nt].at(i);
 	}
 	
+	/**
+	 * @brief Return the one rule of type nt whose format is exactly s, or nullptr if there isn't exactly one (this 
+	 * 		  uses format_index, so it doesn't scan the rules). 
+	 * @param nt
+	 * @param s
+	 * @return 
+	 */
+	[[nodiscard]] Rule* find_rule(const nonterminal_t nt, std::string_view s) const {
+		assert(nt < N_NTs);
+		auto it = format_index[nt].find(s);
+		return it == format_index[nt].end() ? nullptr : it->second;
+	}
+	
 	[[nodiscard]] virtual Rule* get_rule(const nonterminal_t nt, const std::string s) const {
 		/**
 		 * @brief Return a rule based on s, which must uniquely be a prefix of the rule's format of a given nonterminal type. 
@@ -529,6 +1082,10 @@ public:
 		 * @return 
 		 */
 		
+		// almost always, s is exactly one rule's format (e.g. from parseable), which we can just look up
+		if(auto r = find_rule(nt, s)) 
+			return r;
+		
 		// we're going to allow matches to prefixes, but we have to keep track
 		// if we have matched a prefix so we don't mutliple count (e.g if one rule was "str" and one was "string"),
 		// we'd want to match "string" as "string" and not "str"
@@ -611,17 +1168,26 @@ public:
 
 	virtual Rule* sample_rule(const nonterminal_t nt) const {
 		/**
-		 * @brief Randomly sample a rule of type nt. 
+		 * @brief Randomly sample a rule of type nt, in proportion to the rules' p. 
 		 * @param nt
 		 * @return 
 		 */
 		
-		std::function<double(const Rule& r)> f = [](const Rule& r){return r.p;};
 		if(rules[nt].size() == 0) {
 			print("Failed nonterminal, not in grammar:", nt);
 			assert(false && "*** You are trying to sample from a nonterminal with no rules!");			
 		}
-		return sample<Rule,std::vector<Rule>>(rules[nt], Z[nt], f).first; // ignore the probabiltiy 
+		assert(cumulative_p[nt].size() == rules[nt].size() && "*** Rules were changed without calling probabilities_changed");
+		
+		// This picks the first rule where the running total reaches c.back()*u, like sample does, but with a binary 
+		// search instead of a linear scan. We scale by c.back() rather than Z so that r is always below the total 
+		// and the search can't run off the end. 
+		const auto& c = cumulative_p[nt];
+		assert(c.back() > 0 && "*** Cannot call sample with zero normalizer -- is s empty?");
+		const double r = c.back() * uniform();
+		const size_t i = std::lower_bound(c.begin(), c.end(), r) - c.begin();
+		assert(i < c.size());
+		return const_cast<Rule*>(&rules[nt][i]);
 	}
 	
 	
@@ -682,16 +1248,70 @@ public:
 		return n;
 	}	
 
+	Node __generate_truncated(const nonterminal_t ntfrom, unsigned long depth) const {
+		/**
+		 * @brief Sample a tree of type nt from the grammar's distribution conditioned on the tree not going past 
+		 * 		  GRAMMAR_MAX_DEPTH. Each rule is chosen in proportion to its p times the probability that its children 
+		 * 		  finish (see build_truncation_tables), so this never fails. 
+		 * @param nt
+		 * @param depth
+		 * @return 
+		 */
+		
+		const auto& c = truncated_cumulative_p[ntfrom][depth];
+		
+		const Rule* r;
+		if(c.empty()) {
+			r = sample_rule(ntfrom);
+		}
+		else {
+			assert(c.back() > 0.0);
+			const size_t i = std::lower_bound(c.begin(), c.end(), c.back()*uniform()) - c.begin();
+			assert(i < c.size());
+			r = &rules[ntfrom][i];
+		}
+		
+		Node n = makeNode(r);
+		for(size_t i=0;i<r->N;i++) {
+			n.set_child(i, __generate_truncated(r->type(i), depth+1));
+		}
+		return n;
+	}
+
+	/**
+	 * @brief The log probability that generate(n.nt(), depth) returns n, which is the grammar's probability divided by 
+	 * 		  the probability of finishing under GRAMMAR_MAX_DEPTH. (Proposals::regenerate doesn't need this since it 
+	 * 		  replaces a subtree with one of the same type, so the normalizers cancel.)
+	 * @param n
+	 * @param depth
+	 * @return 
+	 */
+	double truncated_log_probability(const Node& n, size_t depth=0) const {
+		update_truncation_tables();
+		return log_probability(n) - log1p(-depth_failure_p[n.nt()][depth]);
+	}
+
 	/**
 	 * @brief A wrapper to catch DepthExcpetions and retry. This means that defaultly we try to generate GENERATE_DEPTH_EXCEPTION_RETRIES
 	 * 	      times and if ALL of them fail, we throw an assert error. Presumably, unless the grammar is terrible
 	 * 		  one of them will work. This makes our DepthExceptions generally silent to the outside since
 	 * 		  they won't call __generate typically 
+	 * 		  
+	 * 		  When the truncation tables are up to date (see set_max_depth), this samples trees that fit directly 
+	 * 		  (__generate_truncated) and never retries. 
 	 * @param ntfrom
 	 * @param depth
 	 * @return 
 	 */	
 	Node generate(const nonterminal_t ntfrom=nt<output_t>(), unsigned long depth=0) const {
+		
+		update_truncation_tables();
+		
+		// if we can, sample directly from the trees that fit (this has the same distribution as retrying, without the retries)
+		if(truncation_depth == GRAMMAR_MAX_DEPTH and depth < truncation_depth and depth_failure_p[ntfrom][depth] < 1.0) {
+			return __generate_truncated(ntfrom, depth);
+		}
+		
 		for(size_t tries=0;tries<GENERATE_DEPTH_EXCEPTION_RETRIES;tries++) {
 			try {
 				return __generate(ntfrom, depth);
@@ -792,6 +1412,157 @@ public:
 		
 		return out;
 	}
+	
+	/**
+	 * @brief A table of how often each rule was run (and how many cycles were spent in it) in rc, with the most 
+	 * 		  expensive first. This shows which primitives dominate the time spent in the VirtualMachine. Typically 
+	 * 		  rc is RuntimeCounter::profile_total(), which requires compiling with RUNTIME_COUNT_RULES (and 
+	 * 		  RUNTIME_TIME_RULES for cycles). Builtins that aren't run from a rule (e.g. the Jmp in an If) are listed by their Op. 
+	 * @param rc
+	 * @return 
+	 */	
+	std::string runtime_report(const RuntimeCounter& rc) const {
+		
+		struct Line { std::string name; size_t count; size_t cycles; };
+		std::vector<Line> lines;
+		
+		auto at = [](const std::vector<RuntimeCounter::T>& v, size_t i) -> size_t { return i < v.size() ? v[i] : 0; };
+		
+		for(size_t nt=0;nt<N_NTs;nt++) {
+			for(const auto& r : rules[nt]) {
+				lines.push_back(Line{r.format, at(rc.rule_count, r.index), at(rc.rule_cycles, r.index)});
+			}
+		}
+		for(size_t o=0;o<std::max(rc.builtin_count.size(), rc.builtin_cycles.size());o++) {
+			if(at(rc.builtin_count,o) > 0 or at(rc.builtin_cycles,o) > 0) {
+				lines.push_back(Line{"<Op " + str(o) + ">", at(rc.builtin_count,o), at(rc.builtin_cycles,o)});
+			}
+		}
+		
+		size_t total_count = 0, total_cycles = 0; 
+		for(const auto& l : lines) {
+			total_count += l.count;
+			total_cycles += l.cycles;
+		}
+		
+		// sort by time if we have it, otherwise by count
+		std::stable_sort(lines.begin(), lines.end(), [=](const Line& a, const Line& b) { 
+			return total_cycles > 0 ? a.cycles > b.cycles : a.count > b.count; 
+		});
+		
+		std::string out = "# count\tpct.count\tcycles\tpct.cycles\tcycles.per.call\trule\n";
+		for(const auto& l : lines) {
+			out += str(l.count) + "\t" + 
+				   str(total_count  == 0 ? 0.0 : 100.0*l.count/total_count) + "\t" + 
+				   str(l.cycles) + "\t" + 
+				   str(total_cycles == 0 ? 0.0 : 100.0*l.cycles/total_cycles) + "\t" + 
+				   str(l.count == 0 ? 0.0 : double(l.cycles)/l.count) + "\t" + 
+				   l.name + "\n";
+		}
+		return out;
+	}
+	
+	/**
+	 * @brief Can r be part of a superinstruction? It has to be run by just calling its function, so it can't jump, 
+	 * 		  make random choices, or push onto the program (e.g. If, And, Or, Flip, recursion). So besides X, these are
+	 * 		  the Standard rules that can be compiled into closures (those given to add as std::functions), since a rule
+	 * 		  added with add_vms can do any of these. Then the only way one stops the rest of the superinstruction from 
+	 * 		  running is an error, which stops the program anyway. 
+	 * @param r
+	 * @return 
+	 */	
+	static bool can_fuse(const Rule* r) {
+		return (r->is_a(Op::Standard) and r->fptr != nullptr and r->fclosure != nullptr) or r->is_a(Op::X);
+	}
+	
+	/**
+	 * @brief Count the chains of rules in n that could be superinstructions. A chain is a rule, then the rule of its last
+	 * 		  child, then the rule of that one's last child, etc., since these run one right after the other in the program 
+	 * 		  that linearize makes. So this counts the adjacent pairs (and triples, etc. up to maxlen) of instructions that 
+	 * 		  we could fuse. Adding this up over the hypotheses a model finds shows which superinstructions are worth 
+	 * 		  adding (see add_superinstructions). 
+	 * @param n
+	 * @param counts
+	 * @param maxlen
+	 */	
+	void count_chains(const Node& n, std::map<std::vector<const Rule*>,size_t>& counts, size_t maxlen=3) const {
+		for(const auto& ni : n) {
+			if(not can_fuse(ni.rule)) continue;
+			
+			std::vector<const Rule*> chain{ni.rule};
+			const Node* c = &ni;
+			while(chain.size() < maxlen and c->nchildren() > 0) {
+				c = &c->child(c->nchildren()-1);
+				if(not can_fuse(c->rule)) break;
+				
+				chain.push_back(c->rule);
+				counts[chain]++;
+			}
+		}
+	}
+	
+	/**
+	 * @brief Add superinstructions for the k most common chains in counts (see count_chains)
+	 * @param counts
+	 * @param k
+	 */	
+	void add_superinstructions(const std::map<std::vector<const Rule*>,size_t>& counts, size_t k) {
+		std::vector<std::pair<std::vector<const Rule*>,size_t>> v(counts.begin(), counts.end());
+		std::stable_sort(v.begin(), v.end(), [](const auto& a, const auto& b) { return a.second > b.second; });
+		for(size_t i=0;i<std::min(k, v.size());i++) {
+			add_superinstruction(v[i].first);
+		}
+	}
+	
+	/**
+	 * @brief Add a superinstruction for a chain of rules given by their formats, e.g. {"head(%s)", "tail(%s)"}
+	 * @param formats
+	 */	
+	void add_superinstruction(const std::vector<std::string>& formats) {
+		std::vector<const Rule*> chain;
+		for(const auto& f : formats) {
+			chain.push_back(get_rule(f));
+		}
+		add_superinstruction(chain);
+	}
+	
+	/**
+	 * @brief Add a superinstruction: when linearize sees this chain of rules (chain[0], then the rule of its last child, 
+	 * 		  etc.), it emits one instruction that runs all of them, rather than one for each. This is opt-in, since which
+	 * 		  ones help depends on the model (see count_chains). Superinstructions must be added after all of the rules. 
+	 * 		  NOTE: This only changes hypotheses that are compiled after it's added. 
+	 * @param chain
+	 */	
+	void add_superinstruction(const std::vector<const Rule*>& chain) {
+		assert(chain.size() >= 2 && "*** A superinstruction needs at least two rules");
+		
+		std::vector<Instruction> instructions; // in the order they are run (the last in chain first)
+		instructions.reserve(chain.size());
+		for(size_t k=0;k<chain.size();k++) {
+			assert(can_fuse(chain[k]) && "*** This rule can't be part of a superinstruction");
+			assert((k == 0 or (chain[k-1]->N > 0 and chain[k-1]->type(chain[k-1]->N-1) == chain[k]->nt)) && 
+					"*** Each rule in a superinstruction must have the type of the last child of the one before");
+			instructions.push_back(chain[k]->makeInstruction());
+		}
+		std::reverse(instructions.begin(), instructions.end());
+		
+		auto f = new FT([instructions](VirtualMachineState_t* vms, int _a=0) -> void {
+			for(const auto& i : instructions) {
+				vms->execute(i);
+				if(vms->status != vmstatus_t::GOOD) return; // an error (see can_fuse)
+			}
+		});
+		
+		// find chain[0] in rules so we can change it
+		for(auto& r : rules[chain[0]->nt]) {
+			if(&r == chain[0]) {
+				r.superinstructions.push_back(Superinstruction{chain, (void*)f});
+				nsuperinstructions++;
+				return;
+			}
+		}
+		assert(false && "*** The rules in a superinstruction must be from this grammar");
+	}
 
 	
 	// If eigen is defined we can get the transition matrix	
@@ -852,20 +1623,61 @@ public:
 	double log_probability(const Node& n) const {
 		/**
 		 * @brief Compute the log probability of a tree according to the grammar. NOTE: here we ignore nodes that are Null
-		 * 		  meaning that we compute the partial probability
+		 * 		  meaning that we compute the partial probability. This is cached in each node (with our stamp), so 
+		 * 		  after a proposal, only the nodes that changed (and those above them) are recomputed. 
 		 * @param n
 		 * @return 
 		 */
 		
+		double lp;
+		if(n.get_cached_log_probability(stamp, lp)) 
+			return lp;
+		
+		lp = 0.0;
+		for(const auto& c : n.get_children()) {
+			lp += log_probability(c);
+		}
+		if(n.rule != NullRule) {
+			lp += log(n.rule->p) - log(rule_normalizer(n.rule->nt));
+		}
+		
+		n.set_cached_log_probability(stamp, lp);
+		return lp;		
+	}
+	
+	double log_probability(const FlatTree& t) const {
+		/**
+		 * @brief The same as log_probability(Node), but just a scan over t's entries
+		 * @param t
+		 * @return 
+		 */
+		
 		double lp = 0.0;		
-		for(auto& x : n) {
-			if(x.rule == NullRule) continue;
-			lp += log(x.rule->p) - log(rule_normalizer(x.rule->nt));
+		for(const auto& e : t) {
+			if(e.rule == NullRule) continue;
+			lp += log(e.rule->p) - log(rule_normalizer(e.rule->nt));
 		}
 	
 		return lp;		
 	}
 	
+	double log_probability(const SharedNode& n) const {
+		/**
+		 * @brief The same as log_probability(Node), for a SharedNode
+		 * @param n
+		 * @return 
+		 */
+		
+		double lp = 0.0;
+		if(not n.is_null()) {
+			lp += log(n.rule()->p) - log(rule_normalizer(n.nt()));
+		}
+		for(size_t i=0;i<n.nchildren();i++) {
+			lp += log_probability(n.child(i));
+		}
+		return lp;
+	}
+	
 	// ~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~
 	// Implementation of converting strings to nodes 
 	// ~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~
@@ -906,20 +1718,68 @@ public:
 		return v;
 	}
 
-	Node from_parseable(std::string s) const {
+	Node from_parseable(std::string_view s, size_t& pos) const {
+		/**
+		 * @brief The same as from_parseable(std::deque<std::string>&), but reading the nt:format pieces directly out of s 
+		 * 		  starting at pos (and leaving pos after what we read), so nothing is split or copied. 
+		 * @param s
+		 * @param pos
+		 * @return 
+		 */
+		
+		assert(pos <= s.size() && "*** Should not ever get to here at the end of the string -- are you missing arguments?");
+		
+		// this piece goes to the next RuleDelimiter
+		size_t end = s.find(Node::RuleDelimiter, pos);
+		if(end == std::string_view::npos) end = s.size();
+		const std::string_view piece = s.substr(pos, end-pos);
+		pos = end+1;
+		
+		const size_t k = piece.find(Node::NTDelimiter);
+		assert(k != std::string_view::npos && "*** Cannot divide a string without delimiter");
+		const std::string_view pfx = piece.substr(k+1);
+		
+		// null rules:
+		if(pfx == NullRule->format) 
+			return makeNode(NullRule);
+		
+		int nt = 0;
+		[[maybe_unused]] auto [ptr, ec] = std::from_chars(piece.data(), piece.data()+k, nt);
+		assert(ec == std::errc() && "*** Bad nonterminal in from_parseable");
+		
+		// otherwise find the matching rule (falling back to prefix matching in get_rule)
+		Rule* r = find_rule(nt, pfx);
+		if(r == nullptr) 
+			r = this->get_rule(nt, std::string(pfx));
+		
+		Node v = makeNode(r);
+		for(size_t i=0;i<r->N;i++) {	
+		
+			v.set_child(i, from_parseable(s, pos));
+
+			if(r->type(i) != v.child(i).rule->nt) {
+				CERR "*** Grammar expected type " << r->type(i) << " but got type " << v.child(i).rule->nt << " at " << r->format << " argument " << i ENDL;
+				assert(false && "Bad names in from_parseable."); // just check that we didn't miss this up
+			}
+			
+		}
+		return v;
+	}
+
+	Node from_parseable(const std::string& s) const {
 		/**
 		 * @brief Expand from names where s is delimited by ':'
 		 * @param s
 		 * @return 
 		 */
 		
-		std::deque<std::string> stk = split(s, Node::RuleDelimiter);    
-        return from_parseable(stk);
+		size_t pos = 0;
+		return from_parseable(std::string_view(s), pos);
 	}
 	
 	Node from_parseable(const char* c) const {
-		std::string s = c;
-        return from_parseable(s);
+		size_t pos = 0;
+		return from_parseable(std::string_view(c), pos);
 	}
 
 
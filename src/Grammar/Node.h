@@ -2,12 +2,15 @@
 
 #include <functional>
 #include <stack>
+#include <limits>
+#include <cstdint>
 
 #include "IO.h"
 #include "Miscellaneous.h"
 #include "Rule.h"
 #include "Program.h"
 #include "BaseNode.h"
+#include "PoolAllocator.h"
 #include "Builtins.h"
 
 /**
@@ -19,8 +22,8 @@
  *        and the arguments to a rule. Nodes are generated by grammars and the main thing contained
  * 		  in a LOTHypothesis
  */
-class Node : public BaseNode<Node> {
-	friend class BaseNode<Node>;
+class Node : public BaseNode<Node,PoolAllocator<Node>> {
+	friend class BaseNode<Node,PoolAllocator<Node>>;
 	
 public:
 
@@ -33,6 +36,39 @@ public:
 	double       lp; 
 	bool         can_resample;	
 
+protected:
+	
+	// Caches of count(), hash(depth), and Grammar::log_probability for my subtree. These are filled in the first time
+	// they are asked for, and invalidate() empties them for me and everything above me whenever my subtree changes. 
+	// Since computing any of them for a node computes them for its children, a node with nothing cached never has 
+	// an ancestor with anything cached, so invalidate() can stop at the first such node. 
+	static constexpr uint32_t NO_CACHE = std::numeric_limits<uint32_t>::max();
+	mutable size_t   cached_hash = 0;
+	mutable double   cached_lp = 0.0;
+	mutable size_t   cached_lp_stamp = 0;            // the Grammar::stamp that cached_lp was computed with (0 means none)
+	mutable uint32_t cached_count = NO_CACHE;
+	mutable uint32_t cached_hash_depth = NO_CACHE;   // the depth that cached_hash was computed for
+
+	void copy_cache(const Node& n) {
+		cached_hash       = n.cached_hash;
+		cached_lp         = n.cached_lp;
+		cached_lp_stamp   = n.cached_lp_stamp;
+		cached_count      = n.cached_count;
+		cached_hash_depth = n.cached_hash_depth;
+	}
+	
+	void clear_cache() {
+		cached_count = NO_CACHE;
+		cached_hash_depth = NO_CACHE;
+		cached_lp_stamp = 0;
+	}
+	
+	void children_changed() {
+		invalidate();
+	}
+	
+public:
+
 	Node(const Rule* r=nullptr, double _lp=0.0, bool cr=true) : 
 		BaseNode(r==nullptr?0:r->N), rule(r==nullptr ? NullRule : r), lp(_lp), can_resample(cr) {	
 		// NOTE: We don't allow parent to be set here bcause that maeks pi hard to set. We shuold only be placed
@@ -44,30 +80,49 @@ public:
 	/* We must define our own copy and move since parent can't just be simply copied */	
 	Node(const Node& n) :
 		BaseNode(n), rule(n.rule), lp(n.lp), can_resample(n.can_resample) {
+		copy_cache(n);
 	}
 	Node(Node&& n) :
-		BaseNode(n), rule(n.rule), lp(n.lp), can_resample(n.can_resample) {
+		BaseNode(std::move(n)), rule(n.rule), lp(n.lp), can_resample(n.can_resample) { // (BaseNode only moves the children)
+		copy_cache(n);
 	}
 	
 	virtual ~Node() {}
 	
+	/**
+	 * @brief Empty the caches of me and everything above me. This is called whenever a child is set or a node is assigned
+	 * 		  (with assign or =), but if you change a node's rule directly, you must call it yourself. 
+	 */
+	void invalidate() {
+		for(Node* n = this; n != nullptr; n = n->parent) {
+			if(n->cached_count == NO_CACHE and n->cached_hash_depth == NO_CACHE and n->cached_lp_stamp == 0) 
+				break; // so nothing above is cached either
+			
+			n->clear_cache();
+		}
+	}
+	
 	/**
 	 * @brief Assign will set everything to n BUT it will not copy the parent pointer etc since we're assuming
 	 *        this node is staying in the same place
 	 * @param n
 	 */
 	void assign(Node& n) {
+		if(parent != nullptr) parent->invalidate();
 		children = n.children;
 		this->rule = n.rule;
 		this->lp = n.lp;
 		this->can_resample = n.can_resample;	
+		copy_cache(n);
 		fix_child_info(); // update the children so they point to the right parent
 	}
 	void assign(Node&& n) {
+		if(parent != nullptr) parent->invalidate();
 		children = std::move(n.children);
 		this->rule = n.rule;
 		this->lp = n.lp;
 		this->can_resample = n.can_resample;	
+		copy_cache(n);
 		fix_child_info();
 	}
 	
@@ -93,7 +148,7 @@ public:
 		 */
 		assert(i < rule->N);
 		assert(n.rule == NullRule or n.nt() == rule->type(i)); // no type checking when the rule is null
-		BaseNode<Node>::set_child(i,n);
+		BaseNode<Node,PoolAllocator<Node>>::set_child(i,n);
 	}
 	void set_child(const size_t i, Node&& n) {
 		/**
@@ -107,28 +162,42 @@ public:
 			assert(false);
 		}
 		assert(n.rule == NullRule or n.nt() == rule->type(i)); // no type checking when the rule is null
-		BaseNode<Node>::set_child(i,std::move(n));
+		BaseNode<Node,PoolAllocator<Node>>::set_child(i,std::move(n));
 	}
 
 
 	void operator=(const Node& n) {
 		// Here in the assignment operator we don't set the parent to n.parent, otherwise the parent pointers get broken
 		// (nor pi). This leaves them in their place in a tree (so e.g. we can set a node of a tree and it still works)
+		Node* p = parent;
+		size_t i = pi;
 		
-		BaseNode<Node>::operator=(n);
+		BaseNode<Node,PoolAllocator<Node>>::operator=(n);
 		
+		this->parent = p;
+		this->pi = i;
 		this->rule = n.rule;
 		this->lp = n.lp;
 		this->can_resample = n.can_resample;
+		clear_cache();
+		if(parent != nullptr) parent->invalidate();
 	}
 
 	void operator=(Node&& n) {
+		Node* p = parent;
+		size_t i = pi;
 		
-		BaseNode<Node>::operator=(n);
-		
+		// n might be below us, so take everything but the children before they (and maybe n) are replaced
 		this->rule = n.rule;
 		this->lp = n.lp;
 		this->can_resample = n.can_resample;
+		
+		BaseNode<Node,PoolAllocator<Node>>::operator=(std::move(n));
+		
+		this->parent = p;
+		this->pi = i;
+		clear_cache();
+		if(parent != nullptr) parent->invalidate();
 	}
 	
 	auto operator<=>(const Node& other) const {
@@ -171,6 +240,42 @@ public:
 		return this->rule == NullRule;
 	}
 		
+	using BaseNode<Node,PoolAllocator<Node>>::count;
+	
+	virtual size_t count() const override {
+		/**
+		 * @brief How many nodes are in my subtree (including null ones)? This is cached (see invalidate). 
+		 * @return 
+		 */
+		
+		if(cached_count == NO_CACHE) {
+			size_t n = 1; // me
+			for(const auto& c : children) {
+				n += c.count();
+			}
+			cached_count = n;
+		}
+		return cached_count;
+	}
+	
+	/**
+	 * @brief If my subtree's log probability was cached for the grammar with this stamp (see Grammar::log_probability),
+	 * 		  put it in out and return true.
+	 * @param stamp
+	 * @param out
+	 * @return 
+	 */
+	bool get_cached_log_probability(size_t stamp, double& out) const {
+		if(cached_lp_stamp != stamp) return false;
+		out = cached_lp;
+		return true;
+	}
+	
+	void set_cached_log_probability(size_t stamp, double v) const {
+		cached_lp = v;
+		cached_lp_stamp = stamp;
+	}
+	
 	virtual size_t count_nonnull() const {
 		/**
 		 * @brief How many nodes total are below me?
@@ -351,22 +456,133 @@ public:
 			
 			return children[0].linearize<VirtualMachineState_t,Grammar_t>(program)+ysize+1;			
 		}
-		else {
-			[[likely]]
+		else if(not rule->superinstructions.empty()) {
+			
+			// find the longest superinstruction that matches me and my last children
+			const Superinstruction* best = nullptr;
+			for(const auto& s : rule->superinstructions) {
+				const Node* n = this;
+				size_t k = 1;
+				for(;k<s.rules.size() and n->nchildren() > 0;k++) {
+					n = &n->children.back();
+					if(n->rule != s.rules[k]) break;
+				}
+				if(k == s.rules.size() and (best == nullptr or s.rules.size() > best->rules.size())) 
+					best = &s;
+			}
+			
+			if(best == nullptr) {
+				return linearize_children<VirtualMachineState_t,Grammar_t>(program);
+			}
+			
+			// the chain of nodes that best runs
+			std::vector<const Node*> chain{this};
+			while(chain.size() < best->rules.size()) {
+				chain.push_back(&chain.back()->children.back());
+			}
 			
-			/* Else we just process a normal child. 
-			 * Here we push the children in increasing order. Then, when we pop rightmost first (as Primitive does), it 
-			 * assigns the correct index.  */
-			program.push(this->rule->makeInstruction()); 
+			program.push(Instruction(best->f, 0, Op::Standard));
+			int mysize = 1;
 			
-			int mysize = 1; // one for my own instruction
-			for(int i=this->rule->N-1;i>=0;i--) { // here we linearize right to left so that when we call right to left, it matches string order			
-				mysize += this->children[i].linearize<VirtualMachineState_t,Grammar_t>(program);
+			// the bottom of the chain runs all of its children, and the others run all but the last (which is the next in the chain)
+			for(int i=chain.back()->rule->N-1;i>=0;i--) {
+				mysize += chain.back()->children[i].linearize<VirtualMachineState_t,Grammar_t>(program);
+			}
+			for(int k=chain.size()-2;k>=0;k--) {
+				for(int i=chain[k]->rule->N-2;i>=0;i--) {
+					mysize += chain[k]->children[i].linearize<VirtualMachineState_t,Grammar_t>(program);
+				}
+			}
+			return mysize;
+		}
+		else {
+			[[likely]]
+			return linearize_children<VirtualMachineState_t,Grammar_t>(program);
+		}
+	}
+	
+	/**
+	 * @brief Linearize my instruction and then my children (the normal case of linearize)
+	 * @param program
+	 * @return 
+	 */	
+	template<typename VirtualMachineState_t, typename Grammar_t>
+	inline int linearize_children(Program<VirtualMachineState_t> &program) const { 
+		/* Here we push the children in increasing order. Then, when we pop rightmost first (as Primitive does), it 
+		 * assigns the correct index.  */
+		program.push(this->rule->makeInstruction()); 
+		
+		int mysize = 1; // one for my own instruction
+		for(int i=this->rule->N-1;i>=0;i--) { // here we linearize right to left so that when we call right to left, it matches string order			
+			mysize += this->children[i].linearize<VirtualMachineState_t,Grammar_t>(program);
+		}
+		return mysize;
+	}
+
+	template<typename Grammar_t>
+	void stack_depth(std::array<size_t,Grammar_t::N_NTs>& out) const {
+		/**
+		 * @brief Compute the maximum depth that each type's stack reaches when running the program that linearize
+		 * 		  makes for this node. This is just a static analysis of the tree: children are run in order, so
+		 * 		  while child i runs, the values of children 0..i-1 are sitting on the stacks below it. For If/And/Or
+		 * 		  the bool is popped before the branches run, so we take the max over the parts.
+		 * 		  NOTE: This does not know about anything pushed inside recursive calls, so it is a lower bound on
+		 * 		  programs that recurse.
+		 * @param out - out[t] is set to the maximum depth of the stack for the t'th nonterminal. This must start
+		 * 				as zeros.
+		 */
+
+		assert(rule != NullRule && "*** Cannot compute stack depth if there is a null rule");
+
+		if(rule->is_a(Op::If) or rule->is_a(Op::And) or rule->is_a(Op::Or)) {
+			[[unlikely]]
+			for(const auto& c : this->children) {
+				std::array<size_t,Grammar_t::N_NTs> d{};
+				c.template stack_depth<Grammar_t>(d);
+				for(size_t t=0;t<Grammar_t::N_NTs;t++)
+					out[t] = std::max(out[t], d[t]);
 			}
-			return mysize; 
 		}
+		else {
+			std::array<size_t,Grammar_t::N_NTs> below{}; // how many of each type my earlier children have left
+			for(const auto& c : this->children) {
+				std::array<size_t,Grammar_t::N_NTs> d{};
+				c.template stack_depth<Grammar_t>(d);
+				for(size_t t=0;t<Grammar_t::N_NTs;t++)
+					out[t] = std::max(out[t], below[t]+d[t]);
+				below[c.nt()]++;
+			}
+		}
+
+		// and then my own return value goes on
+		out[this->nt()] = std::max(out[this->nt()], (size_t)1);
 	}
+
+	
+	/**
+	 * @brief Find where this and n differ. If they differ in exactly one subtree (as they do after most proposals), this 
+	 * 		  returns the smallest subtrees of each that contain all of the differences; if they are equal, it returns 
+	 * 		  nullptrs. 
+	 * @param n
+	 * @return 
+	 */	
+	std::pair<const Node*, const Node*> difference(const Node& n) const {
+		if(not (*rule == *n.rule) or this->children.size() != n.children.size()) 
+			return {this, &n};
+		
+		const Node* a = nullptr;
+		const Node* b = nullptr;
+		for(size_t i=0;i<this->children.size();i++) {
+			if(not (this->children[i] == n.children[i])) {
+				if(a != nullptr) return {this, &n}; // more than one child differs
+				a = &this->children[i];
+				b = &n.children[i];
+			}
+		}
 		
+		if(a == nullptr) return {nullptr, nullptr};
+		else             return a->difference(*b);
+	}
 	
 	virtual bool operator==(const Node& n) const override {
 		/**
@@ -390,15 +606,21 @@ public:
 	
 	virtual size_t hash(size_t depth=0) const {
 		/**
-		 * @brief Hash a tree by hashing the rule and everything below. 
+		 * @brief Hash a tree by hashing the rule and everything below. This is cached (see invalidate). 
 		 * @param depth
 		 * @return 
 		 */
 		
+		if(cached_hash_depth == depth) 
+			return cached_hash;
+		
 		size_t ret = rule->get_hash(); // tunrs out, this is actually important to prevent hash collisions when rule_id and i are small
 		for(size_t i=0;i<this->children.size();i++) {
 			hash_combine(ret, depth, this->children[i].hash(depth+1), i); // modifies output
 		}
+		
+		cached_hash = ret;
+		cached_hash_depth = depth;
 		return ret;
 	}
 
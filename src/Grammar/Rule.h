@@ -10,6 +10,19 @@
 #include "Strings.h"
 #include "IO.h"
 
+class Rule;
+
+/**
+ * @brief A superinstruction runs a chain of rules as a single instruction, which saves the VirtualMachineState from 
+ * 		  dispatching each one. rules[0] is the rule that has this superinstruction, and each rule after that is the 
+ * 		  rule of the *last* child of the one before it, since the last child runs right before its parent. 
+ * 		  See Grammar::add_superinstruction and Node::linearize.
+ */
+struct Superinstruction {
+	std::vector<const Rule*> rules;
+	void* f; // the function that runs them all
+};
+
  /**
   * @class Rule
   * @author piantado
@@ -33,6 +46,10 @@ public:
 	void*					   fptr;
 	Op 						   op; // for ops that need names
 	int 					   arg=0;
+	uint16_t 				   index=Instruction::NO_RULE; // where am I in Grammar::get_rule_indexer's order? (set by Grammar; goes into my instructions)
+	void*					   fbatch=nullptr; // a version of fptr that runs on columns (see BatchVirtualMachineState), if there is one
+	void*					   fclosure=nullptr; // a ClosureCompiler for compiling nodes with this rule into closures (see Closure.h), if there is one
+	std::vector<Superinstruction> superinstructions; // chains starting with me that are run as one instruction (usually empty)
 	std::vector<nonterminal_t> child_types; // An array of what I expand to; note that this should be const but isn't to allow list initialization (https://stackoverflow.com/questions/5549524/how-do-i-initialize-a-member-array-with-an-initializer-list)
 
 protected:
@@ -91,11 +108,11 @@ public:
 	// and in the other we specify what a should be 
 	Instruction makeInstruction(int a) const {
 		assert(arg==0 && "*** You have specified a when arg != 0 -- this is probably a mistake.");
-		return Instruction(fptr, a);
+		return Instruction(fptr, a, op, index);
 	}
 	
 	Instruction makeInstruction() const {
-		return Instruction(fptr, arg);
+		return Instruction(fptr, arg, op, index);
 	}
 	
 	
@@ -0,0 +1,266 @@
+#pragma once
+
+#include <vector>
+#include <string>
+#include <memory>
+#include <array>
+#include <mutex>
+#include <unordered_map>
+
+#include "Miscellaneous.h"
+#include "Rule.h"
+#include "Node.h"
+
+/**
+ * @class SharedNode
+ * @author Steven Piantadosi
+ * @date 18/10/26
+ * @file SharedNode.h
+ * @brief An immutable, hash-consed version of Node. Every SharedNode is made through make(), which looks in a global
+ * 		  table for an existing node with the same rule, can_resample, and children, and returns that one if there is
+ * 		  one. So identical subtrees are stored once, no matter how many trees (hypotheses, chains, TopN entries) they
+ * 		  are in, and equality is just comparing pointers. Each node also stores its hash, size, count, and how many
+ * 		  nodes below it can be resampled, so these are O(1). Changing a subtree (replace) makes new nodes only for the
+ * 		  path from the root down to it and shares everything else with the old tree, which is what
+ * 		  Proposals::regenerate does on SharedNodes.
+ * 		  The table only holds weak pointers, so nodes are freed when no tree uses them. It is split into shards (by
+ * 		  hash), each with its own lock, so SharedNodes can be made in any thread and threads rarely wait on each other.
+ * 		  Expired entries are removed from a shard whenever it has grown to twice its size after its last cleaning.
+ * 		  NOTE: Unlike Node::operator==, two nodes that differ only in can_resample or lp are not equal here (lp is
+ * 		  normally determined by the rule, see Grammar::makeNode, so this only happens if the grammar's probabilities
+ * 		  change).
+ */
+class SharedNode {
+
+	struct Data {
+		const Rule*             rule;
+		double                  lp;
+		bool                    can_resample;
+		std::vector<SharedNode> children;
+		size_t                  hash;
+		size_t                  size;      // how many nodes are in this subtree, including null ones
+		size_t                  count;     // how many non-null nodes are in this subtree (as in Node::count)
+		size_t                  nresample; // how many nodes in this subtree have can_resample
+	};
+
+	std::shared_ptr<const Data> p;
+
+	SharedNode(std::shared_ptr<const Data> d) : p(std::move(d)) {}
+
+	static constexpr size_t NSHARDS = 64;
+
+	struct alignas(64) Shard {
+		std::mutex lock;
+		std::unordered_multimap<size_t, std::weak_ptr<const Data>> table;
+		size_t last_size = 0; // the size after we last cleaned out expired entries
+	};
+
+	static Shard& shard(size_t h) {
+		static std::array<Shard,NSHARDS> shards;
+		return shards[(h >> 32) % NSHARDS]; // the tables use the low bits, so we use the high ones here
+	}
+
+public:
+
+	/**
+	 * @brief A null node (like Node())
+	 */
+	SharedNode() : SharedNode(make(NullRule, 0.0, true, {})) {
+	}
+
+	/**
+	 * @brief Convert a Node (and everything below it) into shared nodes
+	 * @param n
+	 */
+	SharedNode(const Node& n) : p(nullptr) {
+		std::vector<SharedNode> ch;
+		ch.reserve(n.nchildren());
+		for(const auto& c : n.get_children()) {
+			ch.emplace_back(c);
+		}
+		p = make(n.rule, n.lp, n.can_resample, std::move(ch)).p;
+	}
+
+	/**
+	 * @brief Return the unique node with this rule, lp, can_resample and children, making it if it doesn't exist yet.
+	 * @param rule
+	 * @param lp
+	 * @param can_resample
+	 * @param children
+	 * @return
+	 */
+	static SharedNode make(const Rule* rule, double lp, bool can_resample, std::vector<SharedNode>&& children) {
+		assert(rule != nullptr);
+		assert(children.size() == rule->N or (rule == NullRule and children.empty()));
+
+		size_t h = rule->get_hash();
+		hash_combine(h, can_resample);
+		for(const auto& c : children) {
+			hash_combine(h, c.hash());
+		}
+
+		auto& sh = shard(h);
+		std::lock_guard guard(sh.lock);
+		auto& t = sh.table;
+
+		auto [b, e] = t.equal_range(h);
+		for(auto it = b; it != e; ++it) {
+			auto q = it->second.lock();
+			if(q != nullptr and q->rule == rule and q->lp == lp and q->can_resample == can_resample and q->children == children)
+				return SharedNode(std::move(q));
+		}
+
+		size_t size = 1, count = (rule != NullRule), nresample = can_resample;
+		for(const auto& c : children) {
+			size      += c.size();
+			count     += c.count();
+			nresample += c.p->nresample;
+		}
+
+		auto d = std::make_shared<const Data>(Data{rule, lp, can_resample, std::move(children), h, size, count, nresample});
+		t.emplace(h, d);
+
+		// clean out the nodes that have been freed every time we double in size
+		if(t.size() > 2*sh.last_size + 1024) {
+			std::erase_if(t, [](const auto& kv) { return kv.second.expired(); });
+			sh.last_size = t.size();
+		}
+
+		return SharedNode(std::move(d));
+	}
+
+	/**
+	 * @brief How many nodes (live or not yet cleaned) are in the table?
+	 * @return
+	 */
+	static size_t table_size() {
+		size_t n = 0;
+		for(size_t i=0;i<NSHARDS;i++) {
+			auto& sh = shard(i << 32);
+			std::lock_guard guard(sh.lock);
+			n += sh.table.size();
+		}
+		return n;
+	}
+
+	/**
+	 * @brief Convert back into a Node
+	 * @return
+	 */
+	Node to_node() const {
+		Node n(p->rule, p->lp, p->can_resample);
+		for(size_t i=0;i<p->children.size();i++) {
+			n.set_child(i, p->children[i].to_node());
+		}
+		return n;
+	}
+
+	const Rule* rule()         const { return p->rule; }
+	double      lp()           const { return p->lp; }
+	bool        can_resample() const { return p->can_resample; }
+	size_t      hash()         const { return p->hash; }
+	size_t      size()         const { return p->size; }
+	size_t      count()        const { return p->count; }
+	size_t      nresample()    const { return p->nresample; }
+
+	nonterminal_t nt() const {
+		return p->rule->nt;
+	}
+
+	bool is_null() const {
+		return p->rule == NullRule;
+	}
+
+	size_t nchildren() const {
+		return p->children.size();
+	}
+
+	const SharedNode& child(size_t i) const {
+		return p->children[i];
+	}
+
+	/**
+	 * @brief The i'th node of this tree in preorder (counting null nodes)
+	 * @param i
+	 * @return
+	 */
+	const SharedNode& get(size_t i) const {
+		assert(i < size());
+		if(i == 0) return *this;
+		i--;
+		for(const auto& c : p->children) {
+			if(i < c.size()) return c.get(i);
+			i -= c.size();
+		}
+		assert(false && "*** Should not get here");
+		return *this;
+	}
+
+	/**
+	 * @brief The preorder index (as in get) of the k'th node (in preorder) that has can_resample
+	 * @param k
+	 * @return
+	 */
+	size_t find_resample(size_t k) const {
+		assert(k < nresample());
+		if(p->can_resample) {
+			if(k == 0) return 0;
+			k--;
+		}
+		size_t offset = 1;
+		for(const auto& c : p->children) {
+			if(k < c.nresample()) return offset + c.find_resample(k);
+			k      -= c.nresample();
+			offset += c.size();
+		}
+		assert(false && "*** Should not get here");
+		return 0;
+	}
+
+	/**
+	 * @brief Return a copy of this tree where the i'th node (in preorder, as in get) is replaced by s. This only
+	 * 		  makes new nodes for the path from the root to i.
+	 * @param i
+	 * @param s
+	 * @return
+	 */
+	SharedNode replace(size_t i, const SharedNode& s) const {
+		assert(i < size());
+		if(i == 0) return s;
+
+		i--;
+		std::vector<SharedNode> ch = p->children;
+		for(auto& c : ch) {
+			if(i < c.size()) {
+				c = c.replace(i, s);
+				break;
+			}
+			i -= c.size();
+		}
+		return make(p->rule, p->lp, p->can_resample, std::move(ch));
+	}
+
+	bool operator==(const SharedNode& s) const {
+		return p == s.p;
+	}
+
+	std::string string(bool usedot=true) const {
+		return to_node().string(usedot);
+	}
+
+	std::string parseable() const {
+		return to_node().parseable();
+	}
+};
+
+std::ostream& operator<<(std::ostream& o, const SharedNode& n) {
+	o << n.string();
+	return o;
+}
+
+template<>
+struct std::hash<SharedNode> {
+	std::size_t operator()(const SharedNode& n) const {
+		return n.hash();
+	}
+};
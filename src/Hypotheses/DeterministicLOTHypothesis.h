@@ -21,15 +21,169 @@ public:
 	using output_t  = Super::output_t;
 	using call_output_t = output_t;
 	using VirtualMachineState_t = Super::VirtualMachineState_t;
+	using datum_t   = Super::datum_t;
+	using data_t    = Super::data_t;
+	
+	// Can we run all of the data's inputs at once in compute_likelihood? This needs call to be able to tell 
+	// which input it was called on, and a grammar whose VirtualMachineState we use. 
+	static constexpr bool can_batch = std::equality_comparable<input_t> and 
+									  requires(const datum_t& d) { { d.input } -> std::convertible_to<input_t>; } and
+									  std::is_same<typename _Grammar_t::VirtualMachineState_t, VirtualMachineState_t>::value;
+	
+	// When compute_likelihood runs the program on all of the inputs at once, it keeps the outputs here and 
+	// call returns them (in order) instead of running the program again
+	std::vector<input_t>  batch_inputs;
+	std::vector<output_t> batch_outputs;
+	std::vector<bool>     batch_ok;
+	size_t                batch_next = 0;
+	
+	// Can we compile into a closure (see Closure.h)? This needs our grammar's input_t and VirtualMachineState
+	static constexpr bool can_closure = std::is_same<typename _Grammar_t::input_t, input_t>::value and 
+										std::is_same<typename _Grammar_t::VirtualMachineState_t, VirtualMachineState_t>::value;
+	
+	// The closure that call uses instead of the program (nullptr if we can't make one). This is made by call once 
+	// we've been called VirtualMachineControl::CLOSURE_AFTER_CALLS times since compile (and not in compile, which 
+	// is run in LOTHypothesis's constructors, before these are initialized). 
+	std::shared_ptr<Closure<input_t,output_t>> closure;
+	bool                                       closure_compiled = false;
+	unsigned long                              calls_since_compile = 0;
+	
+	// If VirtualMachineControl::PERSISTENT_MEMO, what MemRecurse has memoized in earlier calls, which call_vms gives to 
+	// each new VirtualMachineState. The memoized values depend on everything our program calls, so this is only 
+	// kept while our program and its loader are the same (memo_loader is the loader that filled it). 
+	// NOTE: So a lexicon that changes its factors in place (without making a new lexicon) must call clear_memo
+	typename VirtualMachineState_t::memo_t memo;
+	const void*                            memo_loader = nullptr;
+	
+	// Can we use FleetArgs::incremental_likelihood? This needs closures (to compare subtrees) and data we can index
+	static constexpr bool can_incremental = can_closure and 
+											requires(const data_t& d) { { d.data() } -> std::convertible_to<const datum_t*>; d.size(); } and
+											requires(const datum_t& d) { { d.input } -> std::convertible_to<input_t>; };
+	
+	// If FleetArgs::incremental_likelihood, the likelihood of each data point, which were computed for value on data,
+	// when Bayesable::data_version was data_version (so we know if the data changed in place). This is shared between 
+	// copies, so after a proposal changes our value we can see what changed. 
+	struct DatumLikelihoods {
+		Node                value;
+		const datum_t*      data;
+		uintmax_t           data_version;
+		std::vector<double> likelihoods;
+	};
+	std::shared_ptr<const DatumLikelihoods> datum_likelihoods;
+	
+	/**
+	 * @brief Compile our value into a program. This also throws away our closure (call will make a new one)
+	 * 		  and anything we've memoized
+	 */	
+	virtual void compile() override {
+		Super::compile();
+		closure = nullptr;
+		closure_compiled = false;
+		calls_since_compile = 0;
+		clear_memo();
+	}
+	
+	void clear_memo() {
+		memo = {};
+		memo_loader = nullptr;
+	}
 	
 	/**
 	 * @brief A variant of call that assumes no stochasticity and therefore outputs only a single value. 
 	 * 		  (This uses a nullptr virtual machine pool, so will throw an error on flip)
+	 * 		  If VirtualMachineControl::USE_CLOSURES and every rule in the program can be compiled into a closure, 
+	 * 		  then after the first few calls this runs the closure (call_closure); otherwise it runs the program on a 
+	 * 		  VirtualMachineState (call_vms).
 	 * @param x
 	 * @param err
 	 * @return 
 	 */
 	virtual output_t call(const input_t x, const output_t& err=output_t{}) {
+		if constexpr (std::is_same<typename VirtualMachineState_t::input_t, input_t>::value and 
+					  std::is_same<typename VirtualMachineState_t::output_t, output_t>::value) {
+			
+			assert(not this->program.empty());
+			
+			// if compute_likelihood already ran this input in a batch, we just return that
+			if constexpr (can_batch) {
+				if(batch_next < batch_inputs.size() and batch_inputs[batch_next] == x) {
+					const size_t k = batch_next++;
+					return batch_ok[k] ? batch_outputs[k] : err;
+				}
+			}
+			
+			if constexpr (can_closure) {
+				if(not closure_compiled and ++calls_since_compile > VirtualMachineControl::CLOSURE_AFTER_CALLS) {
+					compile_closure();
+				}
+				
+				if(closure != nullptr) {
+					return call_closure(x, err);
+				}
+			}
+			
+			return call_vms(x, err);
+			
+		} else {
+			print(typeid(input_t).name(), typeid(output_t).name(), typeid(typename VirtualMachineState_t::input_t).name(), typeid(typename VirtualMachineState_t::output_t).name()); 
+			UNUSED(x); UNUSED(err); 
+			assert(false && "*** Cannot use call when VirtualMachineState_t has different input_t or output_t."); 
+		}
+	}
+	
+	/**
+	 * @brief Make our closure, if VirtualMachineControl::USE_CLOSURES and every rule can be compiled. We don't when the
+	 * 		  program is longer than MAX_RUN_PROGRAM, since then a VirtualMachineState would give an error. 
+	 */	
+	void compile_closure() {
+		closure = nullptr;
+		if constexpr (can_closure) {
+			if(VirtualMachineControl::USE_CLOSURES and this->program.size() <= VirtualMachineControl::MAX_RUN_PROGRAM) {
+				closure = grammar->template compile_closure<output_t>(this->get_value());
+			}
+		}
+		closure_compiled = true;
+	}
+	
+	/**
+	 * @brief Call by running our closure (which must have been made by compile_closure). Like call_vms, this sets 
+	 * 		  total_instruction_count_last_call and adds to FleetStatistics::vm_ops, counting each closure that was run
+	 * 		  (see closure_ops) as an instruction. This is the number of instructions a VirtualMachineState would run, 
+	 * 		  except for the jumps that If adds. 
+	 * @param x
+	 * @param err
+	 * @return 
+	 */	
+	output_t call_closure(const input_t& x, const output_t& err=output_t{}) {
+		assert(closure != nullptr);
+		
+		this->was_called = true; 
+		this->total_vms_steps = 1;
+		
+		const unsigned long start = closure_ops();
+		auto count = [&]() {
+			const unsigned long ops = closure_ops() - start;
+			this->total_instruction_count_last_call = ops;
+			FleetStatistics::vm_ops += ops;
+		};
+		
+		try { 
+			auto out = (*closure)(x);
+			count();
+			return out;
+		} catch(VMSRuntimeError& e) {
+			count();
+			return err;
+		}
+	}
+	
+	/**
+	 * @brief Call by running our program on a VirtualMachineState
+	 * @param x
+	 * @param err
+	 * @return 
+	 */	
+	output_t call_vms(const input_t& x, const output_t& err=output_t{}) {
 		if constexpr (std::is_same<typename VirtualMachineState_t::input_t, input_t>::value and 
 					  std::is_same<typename VirtualMachineState_t::output_t, output_t>::value) {
 			
@@ -39,12 +193,26 @@ public:
 			// the savings is that we don't have to create a VirtualMachinePool		
 			VirtualMachineState_t vms(x, err, nullptr);		
 
-			vms.program = this->program; // write my program into vms (program->loader is used for everything else)
+			// write my program into vms (program->loader is used for everything else)
+			vms.program.loader = this->program.loader;
+			vms.program.push(this->program); 
+			vms.reserve(this->program); // stacks only allocate if this program is deeper than they store inline
 			
 			// see below in call()
 			this->was_called = true; 
 			
+			// give vms what we memoized before (if it was with the same loader), and take it back when it's done
+			const bool persist = VirtualMachineControl::PERSISTENT_MEMO;
+			if(persist) {
+				if(memo_loader != this->program.loader) clear_memo();
+				memo_loader = this->program.loader;
+				vms.swap_memo(memo);
+			}
+			
 			const auto out = vms.run(); 	
+			
+			if(persist) vms.swap_memo(memo);
+			
 			this->total_instruction_count_last_call = vms.runtime_counter.total;
 			this->total_vms_steps = 1;
 			
@@ -57,4 +225,192 @@ public:
 		}
 	}
 	
+	/**
+	 * @brief Run the program on all of xs at once with a BatchVirtualMachineState, so that each instruction is dispatched
+	 * 		  once for all of the inputs. Inputs that get an error have ok[k]=false. 
+	 * @param xs
+	 * @param out
+	 * @param ok
+	 * @return false (and nothing is run) if the program can't be run like this, e.g. if it uses recursion or a 
+	 * 		   primitive added with add_vms; then you have to use call. 
+	 */	
+	bool call_batch(const std::vector<input_t>& xs, std::vector<output_t>& out, std::vector<bool>& ok) {
+		if constexpr (can_batch) {
+			using BatchVirtualMachineState_t = typename _Grammar_t::BatchVirtualMachineState_t;
+			
+			assert(not this->program.empty());
+			
+			if(not BatchVirtualMachineState_t::can_run(this->program, grammar->batch_functions)) 
+				return false;
+			
+			out.assign(xs.size(), output_t{});
+			ok.assign(xs.size(), false);
+			
+			// lanes that split off (at an If, etc.) go into work, which we run until its empty
+			std::vector<BatchVirtualMachineState_t> work;
+			work.emplace_back(xs, &grammar->batch_functions);
+			work.back().program.loader = this->program.loader;
+			work.back().program.push(this->program);
+			
+			this->was_called = true; 
+			this->total_instruction_count_last_call = 0;
+			this->total_vms_steps = 0;
+			while(not work.empty()) {
+				auto b = std::move(work.back()); work.pop_back();
+				b.run(out, ok, work);
+				
+				FleetStatistics::vm_ops += b.steps; // NOTE: b.steps includes the steps before it split off, so this is an overcount
+				this->total_instruction_count_last_call = std::max(this->total_instruction_count_last_call, b.steps);
+				this->total_vms_steps++;
+			}
+			
+			return true;
+		}
+		else {
+			UNUSED(xs); UNUSED(out); UNUSED(ok);
+			return false; 
+		}
+	}
+	
+	/**
+	 * @brief If FleetArgs::batch_likelihood, this runs the program on all of the data's inputs with call_batch first, and then
+	 * 		  computes the likelihood as usual, except call returns the outputs from the batch. Note that this runs all of 
+	 * 		  the inputs, even if the likelihood would break out early. 
+	 * @param data
+	 * @param breakout
+	 * @return 
+	 */	
+	virtual double compute_likelihood(const data_t data, const double breakout=-infinity) override {
+		if constexpr (can_incremental) {
+			if(FleetArgs::incremental_likelihood) {
+				return compute_incremental_likelihood(data, breakout);
+			}
+		}
+		
+		if constexpr (can_batch) {
+			if(FleetArgs::batch_likelihood) {
+				
+				// this makes sure that batch_inputs is cleared, even if something throws, so call doesn't return stale outputs
+				struct ClearBatch {
+					DeterministicLOTHypothesis* h;
+					~ClearBatch() { h->batch_inputs.clear(); h->batch_next = 0; }
+				} clear_batch{this};
+				
+				batch_inputs.clear();
+				for(const auto& d : data) {
+					batch_inputs.push_back(d.input);
+				}
+				
+				if(not call_batch(batch_inputs, batch_outputs, batch_ok)) {
+					batch_inputs.clear();
+				}
+				
+				return Super::compute_likelihood(data, breakout);
+			}
+		}
+		
+		return Super::compute_likelihood(data, breakout);
+	}
+	
+	/**
+	 * @brief Compute the likelihood like Bayesable::compute_likelihood, but reusing the likelihoods of the data points that
+	 * 		  could not have changed since datum_likelihoods was computed. When our value differs from that one in a single
+	 * 		  subtree, then (as long as the program doesn't recurse, so every X is the input) the output on x can only 
+	 * 		  change if the old and new subtrees have different values on x. Those are compared by compiling them into 
+	 * 		  closures, and everything else is recomputed. Saved likelihoods are only used for the same data (at the same
+	 * 		  address, and with the same Bayesable::data_version, so code that changes data in place must call data_changed).
+	 * 		  NOTE: This assumes that compute_single_likelihood only depends on the datum and our output for it. 
+	 * @param data
+	 * @param breakout
+	 * @return 
+	 */	
+	double compute_incremental_likelihood(const data_t& data, const double breakout=-infinity) {
+		if constexpr (can_incremental) {
+			
+			// which data points can we reuse? 
+			std::function<bool(const input_t&)> same = nullptr; 
+			const auto old = datum_likelihoods; // (in case this is shared with a copy that changes it)
+			const uintmax_t version = this->data_version();
+			if(old != nullptr and old->data == data.data() and old->data_version == version and old->likelihoods.size() == data.size() and 
+			   this->recursion_count() == 0 and this->program.size() <= VirtualMachineControl::MAX_RUN_PROGRAM) {
+				
+				auto [a, b] = old->value.difference(this->value);
+				if(a == nullptr) {
+					same = [](const input_t& x) { return true; };
+				}
+				else if(a->nt() == b->nt() and a->count() + b->count() < this->value.count()) { // else comparing costs more than running
+					same = make_comparer(*a, *b, std::make_index_sequence<_Grammar_t::N_NTs>{});
+				}
+			}
+			
+			auto out = std::make_shared<DatumLikelihoods>(DatumLikelihoods{this->value, data.data(), version, std::vector<double>(data.size())});
+			datum_likelihoods = nullptr;
+			
+			this->likelihood = 0.0;
+			for(size_t di=0;di<data.size();di++) {
+				const auto& d = data[di];
+				
+				const double sll = (same != nullptr and same(d.input)) ? old->likelihoods[di] : this->compute_single_likelihood(d);
+				out->likelihoods[di] = sll;
+				
+				this->likelihood += sll;
+				
+				// these are the same as Bayesable::compute_likelihood, and leave us without datum_likelihoods
+				if(this->likelihood == -infinity or std::isnan(this->likelihood)) return this->likelihood;
+				
+				if(FleetArgs::LIKELIHOOD_BREAKOUT){
+					assert((sll <= 0 or breakout==-infinity) && "*** Cannot use breakout if likelihoods are positive");
+					if(this->likelihood < breakout) {
+						return this->likelihood = -infinity; 
+					}
+				}
+				
+				if(CTRL_C) {
+					return this->likelihood = NaN;
+				}
+			}
+			
+			datum_likelihoods = out;
+			return this->likelihood;
+		}
+		else {
+			UNUSED(data); UNUSED(breakout);
+			throw NotImplementedError("*** Cannot use incremental likelihoods with this hypothesis");
+		}
+	}
+	
+	/**
+	 * @brief Make a function that checks if a and b (whose type is the I'th of the grammar's) have the same value on x 
+	 * 		  (and neither gives an error), or return nullptr if they can't both be compiled into closures. 
+	 * @param a
+	 * @param b
+	 * @return 
+	 */	
+	template<size_t... I>
+	static std::function<bool(const input_t&)> make_comparer(const Node& a, const Node& b, std::index_sequence<I...>) {
+		std::function<bool(const input_t&)> out = nullptr;
+		(void)(((I == a.nt()) and (out = make_comparer<std::tuple_element_t<I,typename _Grammar_t::TypeTuple>>(a, b), true)) or ...);
+		return out;
+	}
+	
+	template<typename T>
+	static std::function<bool(const input_t&)> make_comparer(const Node& a, const Node& b) {
+		if constexpr (std::equality_comparable<T>) {
+			auto ca = grammar->template compile_closure<T>(a);
+			auto cb = grammar->template compile_closure<T>(b);
+			if(ca == nullptr or cb == nullptr) return nullptr;
+			
+			return [ca,cb](const input_t& x) -> bool {
+				try { 
+					return (*ca)(x) == (*cb)(x);
+				} catch(VMSRuntimeError& e) {
+					return false; 
+				}
+			};
+		}
+		else {
+			return nullptr;
+		}
+	}
+	
 };
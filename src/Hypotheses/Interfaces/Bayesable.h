@@ -4,6 +4,7 @@
 #include <iomanip>
 #include <signal.h>
 #include <span>
+#include <atomic>
 
 #include "FleetArgs.h"
 #include "Errors.h"
@@ -55,6 +56,22 @@ public:
 	virtual std::string string(std::string prefix="") const = 0; 
 	virtual double compute_prior() = 0; 	
 	
+	/**
+	 * @brief A counter that goes up each time data_changed is called. Anything that changes data in place (so it is at 
+	 * 		  the same address but holds something else) must call data_changed, so that likelihoods saved for the old 
+	 * 		  data are not reused (see DeterministicLOTHypothesis::compute_incremental_likelihood). MCMCChain::set_data 
+	 * 		  calls it. 
+	 * @return 
+	 */	
+	static std::atomic<uintmax_t>& data_version() {
+		static std::atomic<uintmax_t> v(0);
+		return v;
+	}
+	
+	static void data_changed() {
+		data_version()++;
+	}
+	
 	/**
 	 * @brief Compute the likelihood of a single data point
 	 * @param datum
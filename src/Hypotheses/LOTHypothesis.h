@@ -200,10 +200,24 @@ public:
 		throw NotImplementedError("*** You must define compute_single_likelihood");// for base classes to implement, but don't set = 0 since then we can't create Hypothesis classes. 
 	}           
 
-	void compile() {
+	virtual void compile() {
 		this->program.clear();
-		value.template linearize<VirtualMachineState_t, Grammar_t>(this->program);
+		if(VirtualMachineControl::SUBTREE_CACHE) {
+			grammar->template linearize_cached<VirtualMachineState_t>(value, this->program);
+		}
+		else if(VirtualMachineControl::FOLD_CONSTANTS) {
+			grammar->template linearize_folded<VirtualMachineState_t>(value, this->program);
+		}
+		else {
+			value.template linearize<VirtualMachineState_t, Grammar_t>(this->program);
+		}
 		this->program.loader = this; // program loader defaults to myself
+		this->program.mark_tail_calls();
+		
+		// save how deep each stack gets, so that running this can reserve them all at once
+		std::array<size_t,Grammar_t::N_NTs> d{};
+		value.template stack_depth<Grammar_t>(d);
+		this->program.set_stack_depth(std::vector<size_t>(d.begin(), d.end()));
 	}
 
 	/**
@@ -211,12 +225,10 @@ public:
 	 * @param s
 	 * @param k
 	 */
-	virtual void push_program(Program<VirtualMachineState_t>& s) override {
-		this->was_called = true; // by definition we should be setting this if we're a program loader
+	virtual void push_program(ProgramStack<VirtualMachineState_t>& s) override {
+		this->set_was_called(); // by definition we should be setting this if we're a program loader
 		
-		for(auto it = this->program.begin(); it != this->program.end(); it++) {
-			s.push(*it);
-		}		
+		s.push(this->program); // just pushes a frame -- no instructions are copied
 	}
 
 	virtual std::string string(std::string prefix="") const override {
@@ -7,6 +7,8 @@
 #include <tuple>
 
 #include "Node.h"
+#include "FlatTree.h"
+#include "SharedNode.h"
 
 namespace Proposals { 
 		
@@ -146,6 +148,73 @@ namespace Proposals {
 		return std::make_pair(ret, fb);
 	}
 
+	/**
+	 * @brief The same regeneration proposal on a FlatTree: pick a can_resample entry uniformly, generate a new subtree
+	 * 		  of its type, and splice that in where the old subtree was. This copies one array instead of every Node. 
+	 * @param grammar - what grammar to use
+	 * @param from - what tree are we proposing from
+	 * @return A pair of the new proposed tree and the forward-backward log probability (for use in MCMC)
+	 */
+	template<typename GrammarType>
+	std::optional<std::pair<FlatTree,double>> regenerate(GrammarType* grammar, const FlatTree& from) {
+		
+		size_t nresample = 0;
+		for(const auto& e : from) {
+			nresample += e.can_resample;
+		}
+		if(nresample == 0) 
+			return {};
+		
+		// find the k'th entry that we can resample
+		size_t k = myrandom(nresample);
+		size_t s = 0;
+		for(;;s++) {
+			if(from[s].can_resample) {
+				if(k == 0) break;
+				k--;
+			}
+		}
+		
+		double oldgp = grammar->log_probability(from.subtree(s)); // reverse probability generating 
+		
+		FlatTree g(grammar->generate(from.nt(s)));
+		
+		FlatTree ret = from; // copy
+		ret.replace(s, g);
+		
+		double fb = (-log(from.count()) + grammar->log_probability(g)) - 
+				    (-log(ret.count()) + oldgp);
+		
+		return std::make_pair(ret, fb);
+	}
+
+	/**
+	 * @brief The same regeneration proposal on a SharedNode. Only the path from the root to the regenerated node is 
+	 * 		  new; everything else is shared with from. 
+	 * @param grammar - what grammar to use
+	 * @param from - what tree are we proposing from
+	 * @return A pair of the new proposed tree and the forward-backward log probability (for use in MCMC)
+	 */
+	template<typename GrammarType>
+	std::optional<std::pair<SharedNode,double>> regenerate(GrammarType* grammar, const SharedNode& from) {
+		
+		if(from.nresample() == 0) 
+			return {};
+		
+		const size_t s = from.find_resample(myrandom(from.nresample()));
+		const SharedNode& old = from.get(s);
+		
+		double oldgp = grammar->log_probability(old); // reverse probability generating 
+		
+		SharedNode g(grammar->generate(old.nt()));
+		SharedNode ret = from.replace(s, g);
+		
+		double fb = (-log(from.count()) + grammar->log_probability(g)) - 
+				    (-log(ret.count()) + oldgp);
+		
+		return std::make_pair(ret, fb);
+	}
+
 	
 	
 	
@@ -371,6 +440,7 @@ namespace Proposals {
 		// set the rule and its probability -- save us the copying
 		s->rule = *newr;
 		s->lp = (*newr)->p / grammar->Z[s->rule->nt];
+		s->invalidate(); // since we changed the rule directly
 		
 		// here we compute fb while ignoring the normalizing constants which is why we don't use rp
 		double fb = log(sampler(*newr))-log(sampler(oldRule));
@@ -22,45 +22,203 @@ public:
 	using call_output_t = DiscreteDistribution<output_t>; // what does call output?
 	using VirtualMachineState_t = _VirtualMachineState_t;
 	
+	// After a call, this bounds how much probability mass is missing from the returned distribution (see VirtualMachinePool::missing_mass)
+	double missing_mass_last_call = 0.0;
+	
+	// If this is not zero, call uses call_sampled with this many samples instead of enumerating execution paths.
+	// This trades exactness for a cost that doesn't blow up with the number of random choices. 
+	size_t call_samples = FleetArgs::vm_samples; 
+	
 	/**
 	 * @brief Run the virtual machine on input x, and marginalize over execution paths to return a distribution
 	 * 		  on outputs. Note that loader must be a program loader, and that is to handle recursion and 
 	 *        other function calls. 
+	 * 		  This uses a VirtualMachinePool that is kept (per thread) between calls, so that after the first few 
+	 * 		  calls we are reusing its states instead of allocating new ones. 
 	 * @param x - input
 	 * @param err - output value on error
 	 * @param loader - where to load recursive calls
 	 * @return 
 	 */	
 	virtual DiscreteDistribution<output_t> call(const input_t x, const output_t& err=output_t{}) {
-		
+		if(call_samples > 0) {
+			return call_sampled(x, err, call_samples);
+		}
+		else {
+			return call_bounded(x, err, VirtualMachineControl::MASS_TOLERANCE).first;
+		}
+	}
+	
+	/**
+	 * @brief Like call, but stop once the unexplored probability mass is at most tolerance, and also return an upper 
+	 * 		  bound on how much probability mass is missing from the distribution. So if P(o) is the real probability of 
+	 * 		  output o and (d,m) is returned, then exp(d[o]) <= P(o) <= exp(d[o]) + m. This means a likelihood computed from 
+	 * 		  d is a lower bound, and one computed with m added is an upper bound, which is often enough (e.g. to reject 
+	 * 		  an MCMC proposal) without running every execution path. 
+	 * @param x - input
+	 * @param err - output value on error
+	 * @param tolerance - stop when the mass left is at most this (0 means run as long as call does)
+	 * @return 
+	 */	
+	std::pair<DiscreteDistribution<output_t>,double> call_bounded(const input_t x, const output_t& err, double tolerance) {
 		// The below condition is needed in case we create e.g. a lexicon whose input_t and output_t differ from the VirtualMachineState
 		// in that case, these functions are all overwritten and must be called on their own. 
 		if constexpr (std::is_same<typename VirtualMachineState_t::input_t, input_t>::value and 
 				      std::is_same<typename VirtualMachineState_t::output_t, output_t>::value) {
-			assert(not this->program.empty());
-		    
-			VirtualMachinePool<VirtualMachineState_t> pool; 		
+			return with_pool([&](auto& pool) { return call_in_pool(pool, x, err, tolerance); });
+	  } else { UNUSED(x); UNUSED(err); UNUSED(tolerance); assert(false && "*** Cannot use call when VirtualMachineState_t has different input_t or output_t."); }
+	}
+	
+	/**
+	 * @brief Approximate the distribution on outputs with n forward samples, where each random choice is drawn rather
+	 * 		  than branched (see VirtualMachinePool::sample). The samples are split into 
+	 * 		  VirtualMachineControl::POOL_THREADS batches, which WorkerPool runs in parallel; each batch uses the 
+	 * 		  VirtualMachinePool its thread keeps between calls, and gets its own seed, so the result does not depend 
+	 * 		  on which threads run which batches. The returned distribution is normalized over all n samples, so 
+	 * 		  outputs that are errors are missing from it (and counted in missing_mass_last_call).
+	 * @param x - input
+	 * @param err - output value on error
+	 * @param n - how many samples
+	 * @return 
+	 */	
+	DiscreteDistribution<output_t> call_sampled(const input_t x, const output_t& err, size_t n) {
+		assert(n > 0);
+		
+		if constexpr (std::is_same<typename VirtualMachineState_t::input_t, input_t>::value and 
+				      std::is_same<typename VirtualMachineState_t::output_t, output_t>::value) {
+			
+			const size_t nbatches = std::max(1ul, std::min(VirtualMachineControl::POOL_THREADS, n));
 			
-			VirtualMachineState_t* vms = new VirtualMachineState_t(x, err, &pool);	
+			// each batch gives back its (unnormalized) samples, the number of steps, the number of instructions and the number that completed 
+			struct Batch { 
+				DiscreteDistribution<output_t> out; 
+				unsigned long steps = 0;
+				unsigned long instructions = 0;
+				double ncomplete = 0.0;
+			};
 			
-			vms->program = this->program; // copy our program into vms
+			// batch 0 takes the remainder
+			auto batch_size = [&](size_t t) { return n/nbatches + (t == 0 ? n%nbatches : 0); };
+			
+			std::vector<Batch> batches(nbatches);
 			
-			// Ok this is a little odd -- in the original FLT we did not have this set was_called=true
-			// since it was not called by another factor; in retrospect, this is odd because it means the first one called
-			// is never was_called unless it was called by another factor (e.g. not counting the original function call)
-			// But probably it makes sense to make anything in here set was_called=true
 			this->was_called = true; 
-
-			pool.push(vms); // put vms into the pool
 			
-			const auto out = pool.run();	
+			WorkerPool::instance().run(nbatches, [&](size_t t) {
+				const size_t k = batch_size(t);
+				Batch& b = batches[t];
+				with_pool([&](auto& pool) {
+					pool.clear();
+					
+					VirtualMachineState_t* vms = pool.make(x, err);	
+					vms->program.loader = this->program.loader;
+					vms->program.push(this->program); 
+					vms->reserve(this->program);
+					
+					b.out          = pool.sample(vms, k);
+					b.steps        = pool.total_vms_steps;
+					b.instructions = pool.total_instruction_count;
+					b.ncomplete    = (1.0-pool.missing_mass)*k;
+					
+					pool.clear();
+					return 0; 
+				});
+			});
 			
-			// update some stats
-			this->total_instruction_count_last_call = pool.total_instruction_count;
-			this->total_vms_steps = pool.total_vms_steps;
+			// each batch normalized by its own size, so put them all in terms of n
+			DiscreteDistribution<output_t> out;
+			double ncomplete = 0.0;
+			this->total_vms_steps = 0;
+			this->total_instruction_count_last_call = 0;
+			for(size_t t=0;t<nbatches;t++) {
+				const size_t k = batch_size(t);
+				for(const auto& [o, lp] : batches[t].out.values()) {
+					out.addmass(o, lp + log(k) - log(n));
+				}
+				ncomplete += batches[t].ncomplete;
+				this->total_vms_steps += batches[t].steps;
+				this->total_instruction_count_last_call += batches[t].instructions;
+			}
+			this->missing_mass_last_call = std::max(0.0, 1.0 - ncomplete/n);
 			
 			return out;
 			
-	  } else { UNUSED(x); UNUSED(err); assert(false && "*** Cannot use call when VirtualMachineState_t has different input_t or output_t."); }
+		} else { UNUSED(x); UNUSED(err); UNUSED(n); assert(false && "*** Cannot use call when VirtualMachineState_t has different input_t or output_t."); }
+	}
+	
+	/**
+	 * @brief Call f on this thread's VirtualMachinePool, which is kept between calls. If call is run inside of another
+	 * 		  call (e.g. by a primitive), then that pool is busy, so f gets a new one. 
+	 * @param f
+	 * @return 
+	 */	
+	template<typename F>
+	auto with_pool(F f) {
+		auto& shared_pool = thread_pool();
+		bool& shared_pool_in_use = thread_pool_in_use();
+		
+		if(shared_pool_in_use) {
+			VirtualMachinePool<VirtualMachineState_t> pool; 
+			return f(pool);
+		}
+		
+		// this makes sure that shared_pool_in_use is reset even if something throws
+		struct InUse {
+			bool& b;
+			InUse(bool& _b) : b(_b) { b = true; }
+			~InUse() { b = false; }
+		} in_use(shared_pool_in_use);
+		
+		return f(shared_pool);
+	}
+	
+	// these are kept in functions so that every with_pool (whatever its F) gets the same ones
+	static VirtualMachinePool<VirtualMachineState_t>& thread_pool() {
+		thread_local VirtualMachinePool<VirtualMachineState_t> p;
+		return p;
+	}
+	static bool& thread_pool_in_use() {
+		thread_local bool b = false;
+		return b;
+	}
+	
+	/**
+	 * @brief Do the work of call, using pool for the execution
+	 * @param pool
+	 * @param x
+	 * @param err
+	 * @param tolerance
+	 * @return 
+	 */	
+	std::pair<DiscreteDistribution<output_t>,double> call_in_pool(VirtualMachinePool<VirtualMachineState_t>& pool, const input_t& x, const output_t& err, double tolerance) {
+		assert(not this->program.empty());
+		
+		pool.clear(); // in case it has some left from last time
+		
+		VirtualMachineState_t* vms = pool.make(x, err);	
+		
+		// put our program into vms (this shares our instructions, it does not copy them)
+		vms->program.loader = this->program.loader;
+		vms->program.push(this->program); 
+		vms->reserve(this->program); // stacks only allocate if this program is deeper than they store inline
+		
+		// Ok this is a little odd -- in the original FLT we did not have this set was_called=true
+		// since it was not called by another factor; in retrospect, this is odd because it means the first one called
+		// is never was_called unless it was called by another factor (e.g. not counting the original function call)
+		// But probably it makes sense to make anything in here set was_called=true
+		this->was_called = true; 
+
+		pool.push(vms); // put vms into the pool
+		
+		auto out = pool.run_bounded(tolerance);	
+		
+		// update some stats
+		this->total_instruction_count_last_call = pool.total_instruction_count;
+		this->total_vms_steps = pool.total_vms_steps;
+		this->missing_mass_last_call = out.second;
+		
+		pool.clear(); // so that we don't keep states (and whatever they refer to) around until the next call
+		
+		return out;
 	}
-};
+};
\ No newline at end of file
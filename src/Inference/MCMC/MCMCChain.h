@@ -85,12 +85,14 @@ public:
 	virtual ~MCMCChain() { }
 	
 	/**
-	 * @brief Set this data
+	 * @brief Set this data. Since d may be at the same place as our old data, this counts as changing the data (see
+	 * 		  Bayesable::data_changed)
 	 * @param d - what data to set
 	 * @param recompute_posterior - should I recompute the posterior on current?
 	 */
 	void set_data(typename HYP::data_t d, bool recompute_posterior=true) {
 		data = d;
+		HYP::data_changed();
 		if(recompute_posterior) {
 			compute_posterior();
 		}
@@ -16,6 +16,17 @@ namespace FleetStatistics {
 	
 	std::atomic<uintmax_t> depth_exceptions(0); // count up the grammar depth exceptions
 	
+	// how is the SubtreeCache doing? (entries and bytes are its current size)
+	std::atomic<uintmax_t> subtree_cache_hits(0);
+	std::atomic<uintmax_t> subtree_cache_misses(0);
+	std::atomic<uintmax_t> subtree_cache_entries(0);
+	std::atomic<uintmax_t> subtree_cache_bytes(0);
+	
+	// how is Node's PoolAllocator doing? (bytes is how much is currently sitting in free lists)
+	std::atomic<uintmax_t> node_allocations(0);
+	std::atomic<uintmax_t> node_allocation_reuses(0);
+	std::atomic<uintmax_t> node_pool_bytes(0);
+	
 	
 	void reset() {
 		posterior_calls = 0;
@@ -26,5 +37,9 @@ namespace FleetStatistics {
 		global_sample_count = 0;
 		beam_steps = 0;
 		enumeration_steps = 0;
+		subtree_cache_hits = 0;
+		subtree_cache_misses = 0;
+		node_allocations = 0;
+		node_allocation_reuses = 0;
 	}
 }
@@ -0,0 +1,198 @@
+#pragma once
+
+#include <vector>
+#include <deque>
+#include <memory>
+#include <thread>
+#include <mutex>
+#include <condition_variable>
+#include <functional>
+#include <exception>
+#include <algorithm>
+#include <cassert>
+
+#include "Rng.h"
+
+/**
+ * @class WorkerPool
+ * @author Steven Piantadosi
+ * @date 18/10/26
+ * @file WorkerPool.h
+ * @brief Threads that are started once and then kept, for splitting small pieces of work that happen on every
+ * 		  call (VirtualMachinePool::run_parallel and StochasticLOTHypothesis::call_sampled). So we don't pay to start
+ * 		  threads each time, and whatever a thread keeps in thread_local variables (like the VirtualMachinePool that
+ * 		  StochasticLOTHypothesis reuses) is kept between calls too. run(n,f) calls f(0),...,f(n-1) on the caller and up
+ * 		  to n-1 of these threads (but no more threads than the hardware can run at once) and returns once they are 
+ * 		  all done. The caller runs any task no thread has started, so run never waits on work that hasn't begun, and
+ * 		  f may call run itself.
+ * 		  Random numbers: before anything is run, the caller draws one seed per task from its DefaultRNG, and whichever
+ * 		  thread runs f(i) seeds its DefaultRNG with seed i first. So f(i) gets the same random numbers no matter which
+ * 		  thread runs it (and so runs with --seed are replicable), and afterwards the caller's DefaultRNG is as if it
+ * 		  had only drawn the seeds. Each thread also makes its own DefaultRNG (which reads Rng::base) while the thread
+ * 		  that started it waits, so it can't race with that thread drawing random numbers.
+ */
+class WorkerPool {
+
+	struct Job {
+		std::function<void(size_t)> f;
+		std::vector<unsigned long>  seeds;
+		size_t n;
+		size_t next = 0;     // the first task that nobody has started
+		size_t running = 0;  // how many of my tasks are being run by our threads (not the caller)
+		std::exception_ptr error;
+	};
+
+	std::mutex mutex; // guards everything here, including the counts in each Job
+	std::condition_variable work_cv; // our threads wait here for jobs
+	std::condition_variable done_cv; // callers wait here for our threads to finish their tasks (or start)
+	std::deque<std::shared_ptr<Job>> jobs; // jobs with tasks that nobody has started
+	std::vector<std::thread> threads;
+	size_t started = 0; // how many threads have made their DefaultRNG
+	bool stopping = false;
+
+	WorkerPool() {}
+
+	/**
+	 * @brief Take the next task from job. NOTE: The caller must hold mutex.
+	 * @param job
+	 * @return
+	 */
+	size_t take(const std::shared_ptr<Job>& job) {
+		assert(job->next < job->n);
+		size_t i = job->next++;
+		if(job->next == job->n) {
+			std::erase(jobs, job);
+		}
+		return i;
+	}
+
+	/**
+	 * @brief Run task i of job, after seeding this thread's DefaultRNG for it
+	 * @param job
+	 * @param i
+	 */
+	void run_task(Job& job, size_t i) {
+		DefaultRNG.std::mt19937::seed(job.seeds[i]);
+		try {
+			job.f(i);
+		} catch(...) {
+			std::lock_guard guard(mutex);
+			if(job.error == nullptr) job.error = std::current_exception();
+		}
+	}
+
+	void loop() {
+		DefaultRNG.discard(0); // make this thread's rng now (see grow)
+
+		std::unique_lock lock(mutex);
+		started++;
+		done_cv.notify_all();
+
+		while(true) {
+			work_cv.wait(lock, [&]() { return stopping or not jobs.empty(); });
+			if(stopping) return;
+
+			auto job = jobs.front();
+			size_t i = take(job);
+			job->running++;
+
+			lock.unlock();
+			run_task(*job, i);
+			lock.lock();
+
+			if(--job->running == 0) done_cv.notify_all();
+		}
+	}
+
+	/**
+	 * @brief Make sure we have at least k threads, and wait until the new ones have made their DefaultRNGs.
+	 * 		  NOTE: lock must hold mutex.
+	 * @param k
+	 * @param lock
+	 */
+	void grow(size_t k, std::unique_lock<std::mutex>& lock) {
+		while(threads.size() < k) {
+			threads.emplace_back(&WorkerPool::loop, this);
+		}
+		done_cv.wait(lock, [&]() { return started == threads.size(); });
+	}
+
+public:
+
+	WorkerPool(const WorkerPool&) = delete;
+
+	~WorkerPool() {
+		{
+			std::lock_guard guard(mutex);
+			stopping = true;
+		}
+		work_cv.notify_all();
+		for(auto& t : threads) {
+			t.join();
+		}
+	}
+
+	/**
+	 * @brief The pool that everything shares
+	 * @return
+	 */
+	static WorkerPool& instance() {
+		static WorkerPool p;
+		return p;
+	}
+
+	/**
+	 * @brief How many of n tasks can run at the same time? (n, but at most how many threads the hardware runs)
+	 * @param n
+	 * @return
+	 */
+	static size_t concurrency(size_t n) {
+		static const size_t hardware = std::max(1u, std::thread::hardware_concurrency());
+		return std::min(n, hardware);
+	}
+
+	/**
+	 * @brief Call f(0), ..., f(n-1), with up to concurrency(n) at the same time, and return when they are all done. If any of
+	 * 		  them throws, the first exception is rethrown here (after the others are done). A single task is just run
+	 * 		  here, with the caller's DefaultRNG.
+	 * @param n
+	 * @param f
+	 */
+	void run(size_t n, std::function<void(size_t)> f) {
+		if(n == 0) return;
+		if(n == 1) {
+			f(0);
+			return;
+		}
+
+		auto job = std::make_shared<Job>();
+		job->f = std::move(f);
+		job->n = n;
+		for(size_t i=0;i<n;i++) {
+			job->seeds.push_back(DefaultRNG());
+		}
+		const std::mt19937 saved = DefaultRNG; // running tasks here reseeds our rng, so we put it back after
+
+		std::unique_lock lock(mutex);
+		if(concurrency(n) > 1) {
+			grow(concurrency(n)-1, lock);
+			jobs.push_back(job);
+			work_cv.notify_all();
+		}
+
+		while(job->next < job->n) {
+			size_t i = take(job);
+			lock.unlock();
+			run_task(*job, i);
+			lock.lock();
+		}
+		done_cv.wait(lock, [&]() { return job->running == 0; });
+		lock.unlock();
+
+		static_cast<std::mt19937&>(DefaultRNG) = saved;
+
+		if(job->error != nullptr) {
+			std::rethrow_exception(job->error);
+		}
+	}
+};
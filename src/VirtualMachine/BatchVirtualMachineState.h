@@ -0,0 +1,285 @@
+#pragma once
+
+#include <vector>
+#include <tuple>
+#include <functional>
+
+#include "Errors.h"
+#include "Program.h"
+#include "VirtualMachineState.h"
+#include "VirtualMachineControl.h"
+
+/**
+ * @class BatchVirtualMachineState
+ * @author Steven Piantadosi
+ * @date 18/10/26
+ * @file BatchVirtualMachineState.h
+ * @brief This runs one deterministic program on many inputs at once. Each stack holds columns (one value for each
+ * 		  input, or "lane") rather than single values, so each instruction is dispatched once and then runs in a tight
+ * 		  loop over all of the lanes (which the compiler can often vectorize). Primitives get a column version when they
+ * 		  are added with Grammar::add, and these are looked up by the Instruction's rule (see Grammar::batch_functions).
+ * 		  When lanes disagree at an If, And, or Or, the lanes that go the other way are split off into their own
+ * 		  BatchVirtualMachineState, which continues separately (in the worst case, each lane ends up running alone, like a
+ * 		  VirtualMachineState). Lanes that get an error are removed.
+ * 		  Only programs where can_run is true can be run like this -- not ones with recursion, randomness, memoization, or
+ * 		  primitives that work on the VirtualMachineState directly (add_vms).
+ */
+template<typename _t_input, typename _t_output, typename... VM_TYPES>
+class BatchVirtualMachineState : public VirtualMachineControl {
+public:
+
+	using input_t  = _t_input;
+	using output_t = _t_output;
+
+	using this_t = BatchVirtualMachineState<input_t, output_t, VM_TYPES...>;
+	using VirtualMachineState_t = VirtualMachineState<input_t, output_t, VM_TYPES...>;
+
+	// The function type for the column versions of primitives
+	using FT = std::function<void(this_t*,int)>;
+
+	template<typename T>
+	using column_t = std::vector<T>;
+
+	ProgramStack<VirtualMachineState_t> program;
+	std::vector<column_t<input_t>> xstack;
+	std::vector<size_t> lanes; // which of the original inputs is in each lane?
+	unsigned long steps; // how many instructions have we run? (this is the same for every lane)
+
+	// the column version of each rule's function, indexed by Instruction::rule (nullptr if it has none)
+	const std::vector<void*>* batch_functions;
+
+private:
+	template<typename... args>
+	struct stack_t { std::tuple<std::vector<column_t<args>>...> value; };
+	stack_t<VM_TYPES...> _stack;
+
+	std::vector<bool> failed; // which lanes got an error in this instruction?
+	bool any_failed;
+
+public:
+
+	BatchVirtualMachineState(const std::vector<input_t>& xs, const std::vector<void*>* bf) :
+		steps(0), batch_functions(bf), any_failed(false) {
+		xstack.push_back(xs);
+		lanes.resize(xs.size());
+		for(size_t k=0;k<xs.size();k++) {
+			lanes[k] = k;
+		}
+	}
+
+	/**
+	 * @brief Can we run p like this? We can if every instruction is a builtin we handle here or a rule with a column version.
+	 * @param p
+	 * @param bf
+	 * @return
+	 */
+	static bool can_run(const Program<VirtualMachineState_t>& p, const std::vector<void*>& bf) {
+		for(const auto& i : p) {
+			if(i.op == Op::Standard) {
+				if(i.rule == Instruction::NO_RULE or i.rule >= bf.size() or bf[i.rule] == nullptr) return false;
+			}
+			else if(not is_batch_builtin(i.op)) {
+				return false;
+			}
+		}
+		return true;
+	}
+	
+	/**
+	 * @brief Which builtins do we handle? (NOTE: These are not a switch because -Wswitch-enum would make us list every Op)
+	 * @param o
+	 * @return 
+	 */	
+	static constexpr bool is_batch_builtin(Op o) {
+		return o == Op::X or o == Op::Jmp or o == Op::PopX or o == Op::NoOp or
+			   o == Op::If or o == Op::And or o == Op::Or or o == Op::Not or o == Op::Implies or o == Op::Iff;
+	}
+
+	size_t size() const {
+		return lanes.size();
+	}
+
+	template<typename T>
+	std::vector<column_t<T>>& stack() {
+		static_assert(contains_type<T,VM_TYPES...>() && "*** Error type T missing from VM_TYPES");
+		return std::get<std::vector<column_t<T>>>(_stack.value);
+	}
+
+	/**
+	 * @brief Remove and return the top column of type T
+	 * @return
+	 */
+	template<typename T>
+	column_t<T> getpop() {
+		assert(not stack<T>().empty() && "*** Cannot pop from an empty stack -- this should not happen!");
+		column_t<T> x = std::move(stack<T>().back());
+		stack<T>().pop_back();
+		return x;
+	}
+
+	template<typename T>
+	void push(column_t<T>&& x) {
+		assert(x.size() == size());
+		stack<T>().push_back(std::move(x));
+	}
+
+	/**
+	 * @brief Lane k got an error (this is called by primitives, and the lane is removed after the instruction)
+	 * @param k
+	 */
+	void fail(size_t k) {
+		if(not any_failed) {
+			failed.assign(size(), false);
+			any_failed = true;
+		}
+		failed[k] = true;
+	}
+
+	/**
+	 * @brief Keep only the lanes where mask is true (in every column)
+	 * @param mask
+	 */
+	void keep(const std::vector<bool>& mask) {
+		auto filter = [&](auto& col) {
+			size_t j = 0;
+			for(size_t k=0;k<mask.size();k++) {
+				if(mask[k]) col[j++] = std::move(col[k]);
+			}
+			col.resize(j);
+		};
+
+		for(auto& col : xstack) filter(col);
+		std::apply([&](auto&... st) { ((std::for_each(st.begin(), st.end(), filter)), ...); }, _stack.value);
+		filter(lanes);
+	}
+
+	/**
+	 * @brief The lanes where b is v need to do something different from the others. If that's all of them, we return this;
+	 * 		  if it's none, we return nullptr; otherwise, they are split off into a new state (put into work), which we return.
+	 * @param b
+	 * @param v
+	 * @param work
+	 * @return
+	 */
+	this_t* take_lanes(const column_t<bool>& b, bool v, std::vector<this_t>& work) {
+		const size_t n = std::count(b.begin(), b.end(), v);
+		if(n == 0)      return nullptr;
+		if(n == size()) return this;
+
+		std::vector<bool> mask(size());
+		for(size_t k=0;k<size();k++) {
+			mask[k] = (b[k] == v);
+		}
+
+		work.push_back(*this);
+		work.back().keep(mask);
+		mask.flip();
+		this->keep(mask);
+		return &work.back();
+	}
+
+	/**
+	 * @brief Run the builtins that use bool (which only exist if bool is one of our types)
+	 * @param i
+	 * @param work
+	 */	
+	void run_bool(const Instruction& i, std::vector<this_t>& work) {
+		if(i.op == Op::If) {
+			auto b = getpop<bool>();
+			if(auto s = take_lanes(b, false, work)) s->program.popn(i.arg); // skip the x branch
+		}
+		else if(i.op == Op::And) {
+			auto b = getpop<bool>();
+			if(auto s = take_lanes(b, false, work)) {
+				s->program.popn(i.arg); // pop off the other branch
+				s->push(column_t<bool>(s->size(), false));
+			}
+		}
+		else if(i.op == Op::Or) {
+			auto b = getpop<bool>();
+			if(auto s = take_lanes(b, true, work)) {
+				s->program.popn(i.arg);
+				s->push(column_t<bool>(s->size(), true));
+			}
+		}
+		else if(i.op == Op::Not) {
+			stack<bool>().back().flip();
+		}
+		else if(i.op == Op::Implies) {
+			auto x = getpop<bool>();
+			auto& y = stack<bool>().back();
+			for(size_t k=0;k<x.size();k++) y[k] = (not x[k]) or y[k];
+		}
+		else if(i.op == Op::Iff) {
+			auto x = getpop<bool>();
+			auto& y = stack<bool>().back();
+			for(size_t k=0;k<x.size();k++) y[k] = (x[k] == y[k]);
+		}
+		else {
+			assert(false && "*** This should have been caught by can_run");
+		}
+	}
+	
+	/**
+	 * @brief Run until the program is done. Lanes that finish put their output into out (and set ok), and lanes that split
+	 * 		  off are added to work, which the caller must run too. NOTE: This must not be an element of work.
+	 * @param out
+	 * @param ok
+	 * @param work
+	 */
+	void run(std::vector<output_t>& out, std::vector<bool>& ok, std::vector<this_t>& work) {
+
+		while(not program.empty() and not lanes.empty()) {
+
+			if(program.size() + steps > MAX_RUN_PROGRAM) { // same as VirtualMachineState, every lane gets an error
+				return;
+			}
+			steps++;
+
+			Instruction i = program.next();
+
+			if(i.op == Op::Standard) {
+				assert(i.rule < batch_functions->size() and (*batch_functions)[i.rule] != nullptr);
+				auto f = reinterpret_cast<FT*>((*batch_functions)[i.rule]);
+				(*f)(this, i.arg);
+
+				if(any_failed) { // remove the lanes that failed
+					failed.flip();
+					keep(failed);
+					any_failed = false;
+				}
+			}
+			else if(i.op == Op::X) {
+				if constexpr (contains_type<input_t,VM_TYPES...>()) {
+					stack<input_t>().push_back(xstack.back());
+				}
+			}
+			else if(i.op == Op::Jmp) {
+				program.popn(i.arg);
+			}
+			else if(i.op == Op::PopX) {
+				xstack.pop_back();
+			}
+			else if(i.op == Op::NoOp) {
+				// nothing
+			}
+			else {
+				if constexpr (contains_type<bool,VM_TYPES...>()) {
+					run_bool(i, work);
+				}
+				else {
+					assert(false && "*** This should have been caught by can_run");
+				}
+			}
+		}
+
+		if(not lanes.empty()) {
+			auto& o = stack<output_t>().back();
+			for(size_t k=0;k<lanes.size();k++) {
+				out[lanes[k]] = std::move(o[k]);
+				ok[lanes[k]] = true;
+			}
+		}
+	}
+
+};
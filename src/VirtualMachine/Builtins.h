@@ -216,7 +216,10 @@ namespace Builtins {
 		// sample 0,1,2,3, ... <first argument>-1
 		
 		const auto mx = vms->template getpop<T>();
-		if(mx >= MX) throw VMSRuntimeError(); // MX stops us from having stupidly high values
+		if(mx >= MX) { // MX stops us from having stupidly high values
+			vms->status = vmstatus_t::ERROR;
+			return;
+		}
 		
 		const double lp = -log(mx);
 		for(T i=0;i<mx;i++) { 
@@ -233,7 +236,10 @@ namespace Builtins {
 		// sample 0,1,2,3, ... <first argument>-1
 		
 		const auto mx = vms->template getpop<T>();
-		if(mx >= MX) throw VMSRuntimeError(); // MX stops us from having stupidly high values
+		if(mx >= MX) { // MX stops us from having stupidly high values
+			vms->status = vmstatus_t::ERROR;
+			return;
+		}
 		const auto p = vms->template getpop<double>();
 		
 		// find the normalizing constant (NOTE: not in log space for now)
@@ -252,9 +258,10 @@ namespace Builtins {
 	
 	template<typename Grammar_t, typename key_t, typename output_t=typename Grammar_t::output_t>
 	Primitive<> Mem(Op::Mem, BUILTIN_LAMBDA {	
-		auto memindex = vms->template memstack<key_t>().top(); vms->template memstack<key_t>().pop();
-		if(vms->template mem<key_t>().count(memindex)==0) { // you might actually have already placed mem in crazy recursive situations, so don't overwrite if you have
-			vms->template mem<key_t>()[memindex] = vms->template gettop<output_t>(); // what I should memoize should be on top here, but don't remove because we also return it
+		auto memindex = vms->template memstack<key_t>().toppop();
+		// you might actually have already placed mem in crazy recursive situations, so emplace doesn't overwrite if you have
+		if(vms->template mem<key_t>().find(memindex) == nullptr) { 
+			vms->template writable_mem<key_t>().emplace(std::move(memindex), vms->template gettop<output_t>()); // what I should memoize should be on top here, but don't remove because we also return it
 		}
 	});
 	
@@ -276,14 +283,17 @@ namespace Builtins {
 			assert(vms->program.loader != nullptr);
 							
 			if(vms->recursion_depth++ > vms->MAX_RECURSE) { // there is one of these for each recurse
-				throw VMSRuntimeError();
+				vms->status = vmstatus_t::ERROR;
+				return;
 			}
 
 			// if we get here, then we have processed our arguments and they are stored in the input_t stack. 
 			// so we must move them to the x stack (where there are accessible by op_X)
 			auto mynewx = vms->template getpop<input_t>();
-			vms->xstack.push(std::move(mynewx));
-			vms->program.push(Builtins::PopX<Grammar_t>.makeInstruction()); // we have to remember to remove X once the other program evaluates, *after* everything has evaluated
+			if(not vms->tail_recurse(mynewx)) { // if we're in tail position, we reuse our caller's x and PopX
+				vms->xstack.push(std::move(mynewx));
+				vms->program.push(Builtins::PopX<Grammar_t>.makeInstruction()); // we have to remember to remove X once the other program evaluates, *after* everything has evaluated
+			}
 			
 			// push this program 
 			// but we give i.arg so that we can pass factorized recursed
@@ -326,20 +336,21 @@ namespace Builtins {
 		using mykey_t = short; // this is just the default type used for non-lex recursion
 		
 		if(vms->recursion_depth++ > vms->MAX_RECURSE) { // there is one of these for each recurse
-			throw VMSRuntimeError();
+			vms->status = vmstatus_t::ERROR;
+			return;
 		}
 				
 		auto x = vms->template getpop<input_t>(); // get the argument
-		auto memindex = std::make_pair(arg,x);
+		auto memindex = vms->template make_memkey<mykey_t>(mykey_t(arg), x); // hashed once, here
 		
-		if(vms->template mem<mykey_t>().count(memindex)){
-			vms->push(vms->template mem<mykey_t>()[memindex]); // hmm probably should not be a move?
+		if(auto v = vms->template mem<mykey_t>().find(memindex)){
+			vms->template push<output_t>(output_t(*v)); // copy, since the map may be shared with other states
 		}
 		else {	
-			vms->xstack.push(x);	
+			vms->xstack.push(std::move(x));	
 			vms->program.push(Builtins::PopX<Grammar_t>.makeInstruction());
 
-			vms->template memstack<mykey_t>().push(memindex); // popped off by op_MEM			
+			vms->template memstack<mykey_t>().push(std::move(memindex)); // popped off by op_MEM			
 			vms->program.push(Builtins::Mem<Grammar_t,mykey_t,output_t>.makeInstruction());
 
 			vms->program.loader->push_program(vms->program); // this leaves the answer on top
@@ -384,8 +395,10 @@ namespace Builtins {
 				// if we get here, then we have processed our arguments and they are stored in the input_t stack. 
 				// so we must move them to the x stack (where there are accessible by op_X)
 				auto mynewx = vms->template getpop<input_t>();
-				vms->xstack.push(std::move(mynewx));
-				vms->program.push(Builtins::PopX<Grammar_t>.makeInstruction()); // we have to remember to remove X once the other program evaluates, *after* everything has evaluated
+				if(not vms->tail_recurse(mynewx)) {
+					vms->xstack.push(std::move(mynewx));
+					vms->program.push(Builtins::PopX<Grammar_t>.makeInstruction()); // we have to remember to remove X once the other program evaluates, *after* everything has evaluated
+				}
 				
 				// push this program 
 				// but we give i.arg so that we can pass factorized recursed
@@ -444,7 +457,8 @@ namespace Builtins {
 			assert(vms->program.loader != nullptr);
 							
 			if(vms->recursion_depth++ > vms->MAX_RECURSE) { // there is one of these for each recurse
-				throw VMSRuntimeError();
+				vms->status = vmstatus_t::ERROR;
+				return;
 			}
 			
 			// the key here is the index into the lexicon
@@ -454,8 +468,10 @@ namespace Builtins {
 			// if we get here, then we have processed our arguments and they are stored in the input_t stack. 
 			// so we must move them to the x stack (where there are accessible by op_X)
 			auto mynewx = vms->template getpop<input_t>();
-			vms->xstack.push(std::move(mynewx));
-			vms->program.push(Builtins::PopX<Grammar_t>.makeInstruction()); // we have to remember to remove X once the other program evaluates, *after* everything has evaluated
+			if(not vms->tail_recurse(mynewx)) { // if we're in tail position, we reuse our caller's x and PopX
+				vms->xstack.push(std::move(mynewx));
+				vms->program.push(Builtins::PopX<Grammar_t>.makeInstruction()); // we have to remember to remove X once the other program evaluates, *after* everything has evaluated
+			}
 			
 			// push this program 
 			// but we give i.arg so that we can pass factorized recursed
@@ -494,22 +510,23 @@ namespace Builtins {
 		assert(vms->program.loader != nullptr);
 						
 		if(vms->recursion_depth++ > vms->MAX_RECURSE) { // there is one of these for each recurse
-			throw VMSRuntimeError();
+			vms->status = vmstatus_t::ERROR;
+			return;
 		}
 		
 		auto key = vms->template getpop<key_t>();
 		auto x = vms->template getpop<input_t>(); // get the argument
 		
-		auto memindex = std::make_pair(key,x);
+		auto memindex = vms->template make_memkey<key_t>(key, x);
 		
-		if(vms->template mem<key_t>().count(memindex)){
-			vms->push(vms->template mem<key_t>()[memindex]); // copy over here
+		if(auto v = vms->template mem<key_t>().find(memindex)){
+			vms->template push<output_t>(output_t(*v)); // copy over here
 		}
 		else {	
-			vms->xstack.push(x);	
+			vms->xstack.push(std::move(x));	
 			vms->program.push(Builtins::PopX<Grammar_t>.makeInstruction());
 
-			vms->template memstack<key_t>().push(memindex); // popped off by op_MEM			
+			vms->template memstack<key_t>().push(std::move(memindex)); // popped off by op_MEM			
 			vms->program.push(Builtins::Mem<Grammar_t,key_t,output_t>.makeInstruction());
 
 			vms->program.loader->push_program(vms->program,key);  // this leaves the answer on top
@@ -0,0 +1,134 @@
+#pragma once
+
+#include <memory>
+#include <vector>
+#include <functional>
+#include <optional>
+#include <tuple>
+
+#include "Ops.h"
+#include "Miscellaneous.h"
+#include "VMSRuntimeError.h"
+
+/**
+ * @file Closure.h
+ * @author Steven Piantadosi
+ * @date 18/10/26
+ * @brief A second way to run a Node (besides linearizing it into a Program for a VirtualMachineState): compile it into
+ * 		  a tree of typed closures, where each closure calls its children's closures and then the rule's function.
+ * 		  This skips all of the pushing and popping on the typed stacks, but it can only be used for deterministic
+ * 		  programs, and only if every rule knows how to compile itself (see Rule::fclosure and Grammar::compile_closure).
+ * 		  Rules added as std::functions and the builtins X, If, And, Or, Not, Implies, and Iff can; anything that needs
+ * 		  the VirtualMachineState (recursion, randomness, memoization, add_vms) cannot. A closure signals an error by
+ * 		  throwing VMSRuntimeError (which is also what a function returning an empty std::optional does here).
+ */
+
+/**
+ * @brief How many closures this thread has run. Each closure adds one when it runs (like a VirtualMachineState counts 
+ * 		  each instruction), so that DeterministicLOTHypothesis::call_closure can count how many operations a call took. 
+ * @return 
+ */
+unsigned long& closure_ops() {
+	thread_local unsigned long n = 0;
+	return n;
+}
+
+// A compiled closure that returns a T, given the input x
+template<typename input_t, typename T>
+using Closure = std::function<T(const input_t&)>;
+
+// A closure whose type T has been erased, so that a rule can be given closures of different types for its children
+using AnyClosure = std::shared_ptr<void>;
+
+// What a rule stores to compile itself, given the compiled closures for its children (in order)
+using ClosureCompiler = std::function<AnyClosure(const std::vector<AnyClosure>&)>;
+
+/**
+ * @brief Make a closure that computes f on the outputs of the closures c. The children are run in order (as they are
+ * 		  in a Program), since a braced initializer is evaluated from left to right.
+ * @param f
+ * @param c
+ * @return
+ */
+template<typename input_t, typename T, typename... args, size_t... I>
+AnyClosure make_closure(const std::function<T(args...)>& f, const std::vector<AnyClosure>& c, std::index_sequence<I...>) {
+	assert(c.size() == sizeof...(args));
+
+	auto cs = std::make_tuple(std::static_pointer_cast<Closure<input_t,args>>(c[I])...);
+
+	if constexpr (is_specialization<T, std::optional>::value) {
+		using R = typename T::value_type;
+		return std::make_shared<Closure<input_t,R>>([f,cs](const input_t& x) -> R {
+			closure_ops()++;
+			std::tuple<args...> a{ (*std::get<I>(cs))(x)... };
+			auto out = std::apply(f, std::move(a));
+			if(not out.has_value()) throw VMSRuntimeError();
+			return std::move(*out);
+		});
+	}
+	else {
+		return std::make_shared<Closure<input_t,T>>([f,cs](const input_t& x) -> T {
+			closure_ops()++;
+			std::tuple<args...> a{ (*std::get<I>(cs))(x)... };
+			return std::apply(f, std::move(a));
+		});
+	}
+}
+
+/**
+ * @brief Make the closure for a builtin whose Op we know how to compile, or return nullptr. These have to match what
+ * 		  the builtins do in a VirtualMachineState (see Builtins.h and Node::linearize), including the short-circuiting
+ * 		  of If, And, and Or, and that Implies(a,b) is not(b) or a.
+ * @param o
+ * @return
+ */
+template<typename input_t, typename T, typename... args>
+ClosureCompiler* make_builtin_closure_compiler(Op o) {
+
+	if constexpr (sizeof...(args) == 0 and std::is_same<T,input_t>::value) {
+		if(o == Op::X) {
+			return new ClosureCompiler([](const std::vector<AnyClosure>& c) -> AnyClosure {
+				return std::make_shared<Closure<input_t,input_t>>([](const input_t& x) -> input_t { closure_ops()++; return x; });
+			});
+		}
+	}
+
+	if constexpr (std::is_same<std::tuple<T,args...>, std::tuple<bool,bool>>::value) {
+		if(o == Op::Not) {
+			return new ClosureCompiler([](const std::vector<AnyClosure>& c) -> AnyClosure {
+				auto a = std::static_pointer_cast<Closure<input_t,bool>>(c.at(0));
+				return std::make_shared<Closure<input_t,bool>>([a](const input_t& x) -> bool { closure_ops()++; return not (*a)(x); });
+			});
+		}
+	}
+
+	if constexpr (std::is_same<std::tuple<T,args...>, std::tuple<bool,bool,bool>>::value) {
+		if(o == Op::And or o == Op::Or or o == Op::Implies or o == Op::Iff) {
+			return new ClosureCompiler([o](const std::vector<AnyClosure>& c) -> AnyClosure {
+				auto a = std::static_pointer_cast<Closure<input_t,bool>>(c.at(0));
+				auto b = std::static_pointer_cast<Closure<input_t,bool>>(c.at(1));
+				if(o == Op::And)
+					return std::make_shared<Closure<input_t,bool>>([a,b](const input_t& x) -> bool { closure_ops()++; return (*a)(x) and (*b)(x); });
+				else if(o == Op::Or)
+					return std::make_shared<Closure<input_t,bool>>([a,b](const input_t& x) -> bool { closure_ops()++; return (*a)(x) or (*b)(x); });
+				else if(o == Op::Implies)
+					return std::make_shared<Closure<input_t,bool>>([a,b](const input_t& x) -> bool { closure_ops()++; const bool ax = (*a)(x); return (not (*b)(x)) or ax; });
+				else
+					return std::make_shared<Closure<input_t,bool>>([a,b](const input_t& x) -> bool { closure_ops()++; const bool ax = (*a)(x); return (*b)(x) == ax; });
+			});
+		}
+	}
+
+	if constexpr (std::is_same<std::tuple<args...>, std::tuple<bool,T,T>>::value) {
+		if(o == Op::If) {
+			return new ClosureCompiler([](const std::vector<AnyClosure>& c) -> AnyClosure {
+				auto b = std::static_pointer_cast<Closure<input_t,bool>>(c.at(0));
+				auto y = std::static_pointer_cast<Closure<input_t,T>>(c.at(1));
+				auto n = std::static_pointer_cast<Closure<input_t,T>>(c.at(2));
+				return std::make_shared<Closure<input_t,T>>([b,y,n](const input_t& x) -> T { closure_ops()++; return (*b)(x) ? (*y)(x) : (*n)(x); });
+			});
+		}
+	}
+
+	return nullptr;
+}
@@ -46,6 +46,6 @@ struct Primitive {
 	}
 	
 	Instruction makeInstruction(int arg=0) {
-		return Instruction(f,arg);
+		return Instruction(f,arg,op);
 	}
 };
@@ -3,6 +3,7 @@
 #include <assert.h>
 #include <iostream>
 #include <variant>
+#include <cstdint>
 
 #include "VMSRuntimeError.h"
 #include "Ops.h"
@@ -15,17 +16,27 @@
 * @file Instruction.h
 * @brief f here is a point to a void(VirtualMachineState_t* vms, int arg), where arg
 * 	 is just a supplemental argument, used to pass indices in lexica and jump sizes etc
-*      for other primitives
+*      for other primitives. op is copied from the Rule/Primitive that made this instruction, 
+*      and lets VirtualMachineState::run dispatch builtins directly without calling through f. 
+*      rule is the index of the grammar Rule that made this instruction (see Grammar::get_rule_indexer), 
+*      which is used by RuntimeCounter to keep track of what was run. tail is set by Program::mark_tail_calls
+*      on recursive calls that are the last thing their program does, so that they can reuse the caller's frame. 
 */ 
 struct Instruction { 
 public:
 
+	// the value of rule for instructions that weren't made by a grammar rule (e.g. the Jmp in an If)
+	static constexpr uint16_t NO_RULE = 0xFFFF; 
+
 	// the function type we use takes a virtual machine state and returns a status
 	void* f;
 	int arg;
+	Op op; 
+	bool tail; // is this the last thing its program does? (see Program::mark_tail_calls)
+	uint16_t rule; // (this and tail fit in after op, so Instruction is still 16 bytes)
 	
 	// constructors to make this a little easier to deal with
-	Instruction(void* _f=nullptr, int a=0x0) : f(_f), arg(a) {	
+	Instruction(void* _f=nullptr, int a=0x0, Op o=Op::Standard, uint16_t r=NO_RULE) : f(_f), arg(a), op(o), tail(false), rule(r) {	
 		assert(f != nullptr); // we just can't even store null f, and we'll get an error on construction.
 	}		
 };
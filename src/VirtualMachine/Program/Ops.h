@@ -1,6 +1,8 @@
 #pragma once 
 
-enum class Op {
+#include <cstdint>
+
+enum class Op : uint8_t {
 	Standard, 
 	And, Or, Not, Implies, Iff,
 	X,
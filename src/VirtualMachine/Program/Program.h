@@ -1,9 +1,13 @@
-#pragma once 
+#pragma once
+
+#include <atomic>
+#include <memory>
+#include <vector>
 
 #include "Instruction.h"
-#include "Stack.h"
+#include "SmallStack.h"
 
-template<typename VirtualMachineState_t> class Program;
+template<typename VirtualMachineState_t> class ProgramStack;
 
 /**
  * @class ProgramLoader
@@ -20,16 +24,24 @@ public:
 	// we have a variable that is set to true each time we call push_program
 	// this is useful for tracking recursion etc., if we want to make sure
 	// that a lexicon calls every factor or something
-	bool was_called; 
-
-	// This is a bit of hack -- we need a line here for each kind of key we might want to a lexicon. 
-	// For reasons I don't fully understand, the linker will not find this if templated. 
-	
-	virtual void push_program(Program<VirtualMachineState_t>& s)                      { throw NotImplementedError(); }
-	virtual void push_program(Program<VirtualMachineState_t>& s, const short a)       { throw NotImplementedError(); }
-	virtual void push_program(Program<VirtualMachineState_t>& s, const int a)         { throw NotImplementedError(); }
-	virtual void push_program(Program<VirtualMachineState_t>& s, const std::string k) { throw NotImplementedError(); }
+	bool was_called;
 	
+	/**
+	 * @brief Set was_called. This is atomic because push_program may be called by several threads at once 
+	 * 		  (e.g. when a VirtualMachinePool runs in parallel)
+	 */
+	void set_was_called() {
+		std::atomic_ref<bool>(was_called).store(true, std::memory_order_relaxed);
+	}
+
+	// This is a bit of hack -- we need a line here for each kind of key we might want to a lexicon.
+	// For reasons I don't fully understand, the linker will not find this if templated.
+
+	virtual void push_program(ProgramStack<VirtualMachineState_t>& s)                      { throw NotImplementedError(); }
+	virtual void push_program(ProgramStack<VirtualMachineState_t>& s, const short a)       { throw NotImplementedError(); }
+	virtual void push_program(ProgramStack<VirtualMachineState_t>& s, const int a)         { throw NotImplementedError(); }
+	virtual void push_program(ProgramStack<VirtualMachineState_t>& s, const std::string k) { throw NotImplementedError(); }
+
 };
 
 
@@ -38,19 +50,274 @@ public:
  * @author Steven Piantadosi
  * @date 03/09/21
  * @file Program.h
- * @brief A program here stores just a stack of instructions which can be executed by the VirtualMachineState_t.
- * 		  We've optimized the reserve in the constructor to be the fasest. 
+ * @brief A program here stores the compiled instructions for a Node, which can be executed by the VirtualMachineState_t.
+ * 		  The instructions are stored in the order they are pushed by linearize, so they are executed from the back.
+ * 		  Copies of a Program share (reference count) the same instructions, so copying a hypothesis or running
+ * 		  a program does not copy any instructions. Programs are only modified while compiling, and if a shared
+ * 		  program is modified, it first makes its own copy (copy-on-write).
  */
 template<typename VirtualMachineState_t>
-class Program : public Stack<Instruction> {
+class Program {
+
+	// everything that is shared between copies of a Program
+	struct Code {
+		std::vector<Instruction> instructions;
+		
+		// stack_depth[t] is an upper bound on how deep the stack for the t'th type (nonterminal) gets 
+		// while running the instructions, not counting what happens inside of recursive calls. 
+		// This is computed by Node::stack_depth when we compile and lets a VirtualMachineState_t 
+		// reserve its stacks once. Empty means we don't know. 
+		std::vector<size_t> stack_depth;
+		
+		// the functions that push constants computed when compiling (see Grammar::fold_constants). Instructions
+		// point to these, so they are kept here to live exactly as long as the instructions do.
+		std::vector<std::shared_ptr<void>> constants;
+	};
+	
+	std::shared_ptr<Code> code;
+	
+	/**
+	 * @brief Get a version of code that we are allowed to modify (making a copy if someone else has it)
+	 * @return 
+	 */	
+	Code& writable() {
+		if(code == nullptr) {
+			code = std::make_shared<Code>();
+			
+			// This is chosen with a little experimentation, designed to prevent us from having to reallocate too often
+			// when we linearize, and also save us from having to compute program_size() when we linearize (since thats slow)
+			code->instructions.reserve(64);
+		}
+		else if(code.use_count() > 1) {
+			code = std::make_shared<Code>(*code); // someone else has this, so copy before changing
+		}
+		return *code;
+	}
+
 public:
 
-	ProgramLoader<VirtualMachineState_t>* loader; 
+	ProgramLoader<VirtualMachineState_t>* loader;
 
 	Program(ProgramLoader<VirtualMachineState_t>* pl=nullptr) : loader(pl) {
-		// This is chosen with a little experimentation, designed to prevent us from having to reallocate too often
-		// when we linearize, and also save us from having to compute program_size() when we linearize (since thats slow)
-		this->reserve(64);
-	}	
+	}
+
+	/**
+	 * @brief Add i to the end of the program (so it is executed *before* everything else)
+	 * @param i
+	 */
+	void push(const Instruction& i) {
+		writable().instructions.push_back(i);
+	}
+	
+	/**
+	 * @brief Remove all instructions. This does not change any other Program that shares with this one.
+	 */
+	void clear() {
+		code.reset();
+	}
+	
+	/**
+	 * @brief Store the maximum stack depth for each type
+	 * @param d
+	 */
+	void set_stack_depth(std::vector<size_t>&& d) {
+		writable().stack_depth = std::move(d);
+	}
+	
+	/**
+	 * @brief Keep f (the function for an instruction that pushes a constant) alive as long as this program's instructions.
+	 * @param f
+	 */
+	void add_constant(std::shared_ptr<void> f) {
+		writable().constants.push_back(std::move(f));
+	}
+	
+	/**
+	 * @brief Set Instruction::tail on every recursive call that is in tail position, meaning that nothing in this program
+	 * 		  runs after it except for jumps to the end (e.g. a recursion in either branch of an If, or in the second 
+	 * 		  argument of And/Or, at the top of the program). Since instructions run from the back, this just follows
+	 * 		  the jumps from each instruction towards the front and checks that they land exactly on the end. 
+	 */
+	void mark_tail_calls() {
+		if(empty()) return;
+		
+		auto& ins = writable().instructions;
+		for(size_t p=0;p<ins.size();p++) {
+			if(not (ins[p].op == Op::Recurse or ins[p].op == Op::SafeRecurse or 
+			        ins[p].op == Op::LexiconRecurse or ins[p].op == Op::LexiconSafeRecurse)) continue;
+			
+			// next is the index (+1) of the next instruction that will run after p
+			size_t next = p;
+			while(next > 0 and ins[next-1].op == Op::Jmp) {
+				const size_t skip = ins[next-1].arg + 1; // the jump and what it skips
+				if(skip > next) break; // can't happen in a linearized program, but let's not go off the front
+				next -= skip;
+			}
+			ins[p].tail = (next == 0);
+		}
+	}
+	
+	/**
+	 * @brief How deep can the stack for type (nonterminal) t get? Returns 0 if we don't know.
+	 * @param t
+	 * @return 
+	 */
+	size_t stack_depth(const size_t t) const {
+		if(code == nullptr or t >= code->stack_depth.size()) return 0;
+		return code->stack_depth[t];
+	}
+
+	size_t size() const {
+		return code == nullptr ? 0 : code->instructions.size();
+	}
+
+	bool empty() const {
+		return size() == 0;
+	}
+
+	const Instruction* data() const {
+		return code == nullptr ? nullptr : code->instructions.data();
+	}
+
+	const Instruction& operator[](const size_t i) const {
+		return code->instructions[i];
+	}
+
+	const Instruction* begin() const { return data(); }
+	const Instruction* end()   const { return data()+size(); }
 };
 
+
+/**
+ * @class ProgramStack
+ * @author Steven Piantadosi
+ * @date 03/09/21
+ * @file Program.h
+ * @brief This is what a VirtualMachineState_t actually runs. It is a stack of frames, each of which points into the
+ *        instructions of some Program and stores how many of its instructions are left to run (a program counter).
+ * 		  Calling a program (including recursion) therefore just pushes a frame rather than copying its instructions.
+ *        Individual instructions (like PopX) can also be pushed, and these are kept in a separate stack.
+ * 		  NOTE: A frame points into its Program's instructions, so that Program must stay alive while this runs
+ *        (which it does because the hypothesis holding it is what is being called).
+ */
+template<typename VirtualMachineState_t>
+class ProgramStack {
+
+	struct Frame {
+		const Instruction* code; // nullptr means this frame is the top of single
+		size_t pc; // how many instructions are left in this frame -- the next to run is code[pc-1]
+	};
+
+	// these are SmallStacks so that making (and copying) a ProgramStack doesn't allocate unless it gets deep
+	SmallStack<Frame,8> frames;
+	SmallStack<Instruction,4> single; // instructions that were pushed one at a time
+	size_t remaining; // total number of instructions left in all frames
+
+	/**
+	 * @brief Frames are removed lazily once we've run their last instruction, so this clears them off
+	 * 		  before we look at the top.
+	 */
+	void remove_finished_frames() {
+		while(frames.topref().pc == 0) {
+			if(frames.topref().code == nullptr)
+				single.pop();
+			frames.pop();
+		}
+	}
+
+public:
+
+	ProgramLoader<VirtualMachineState_t>* loader;
+
+	ProgramStack(ProgramLoader<VirtualMachineState_t>* pl=nullptr) : remaining(0), loader(pl) {
+	}
+
+	/**
+	 * @brief Push a single instruction, to be run next
+	 * @param i
+	 */
+	void push(const Instruction& i) {
+		single.push(i);
+		frames.push(Frame{nullptr, 1});
+		remaining++;
+	}
+
+	/**
+	 * @brief Push a frame running all of p, to be run next.
+	 * @param p
+	 */
+	void push(const Program<VirtualMachineState_t>& p) {
+		if(p.empty()) return;
+
+		frames.push(Frame{p.data(), p.size()});
+		remaining += p.size();
+	}
+
+	/**
+	 * @brief Return the next instruction and move past it. This is what VirtualMachineState_t::run uses.
+	 * @return
+	 */
+	Instruction next() {
+		assert(remaining > 0);
+		remove_finished_frames();
+
+		auto& f = frames.topref();
+		--f.pc;
+		--remaining;
+		return (f.code == nullptr ? single.topref() : f.code[f.pc]);
+	}
+
+	/**
+	 * @brief Skip the rest of the frame of the instruction that was just run. This is used by tail calls, where the 
+	 * 		  rest of the frame is only jumps to its end (see Program::mark_tail_calls). NOTE: this must be called
+	 * 		  before anything else is pushed, since the top frame is only the current one until then. 
+	 */
+	void end_frame() {
+		auto& f = frames.topref(); // not remove_finished_frames, since if we just ran the last instruction, this is still us
+		remaining -= f.pc;
+		f.pc = 0;
+	}
+
+	[[nodiscard]] Instruction top() {
+		assert(remaining > 0);
+		remove_finished_frames();
+
+		const auto& f = frames.topref();
+		return (f.code == nullptr ? single.topref() : f.code[f.pc-1]);
+	}
+
+	void pop() {
+		next();
+	}
+
+	/**
+	 * @brief Skip the next n instructions (this is how jumps are implemented)
+	 * @param n
+	 */
+	void popn(size_t n) {
+		assert(n <= remaining);
+		while(n > 0) {
+			remove_finished_frames();
+
+			auto& f = frames.topref();
+			const size_t k = std::min(n, f.pc);
+			f.pc -= k;
+			remaining -= k;
+			n -= k;
+		}
+	}
+
+	size_t size() const {
+		return remaining;
+	}
+
+	bool empty() const {
+		return remaining == 0;
+	}
+
+	void clear() {
+		frames.clear();
+		single.clear();
+		remaining = 0;
+	}
+};
@@ -2,9 +2,30 @@
 
 #include <atomic>
 #include <vector>
+#include <set>
+#include <mutex>
 #include "Instruction.h"
 #include "Miscellaneous.h"
 
+#if defined(__x86_64__) || defined(__i386__)
+#include <x86intrin.h>
+#else 
+#include <chrono>
+#endif
+
+// If defined, RuntimeCounter keeps track of how many times each grammar rule (and each builtin that isn't from a 
+// rule, like the Jmp in an If) is run. This is kept both in each VirtualMachineState and for everything a thread
+// runs (see RuntimeCounter::profile), and Grammar::runtime_report displays them. It is off by default
+// because it costs a little on every instruction. 
+//#define RUNTIME_COUNT_RULES 1
+
+// If defined, the profile also adds up how many cycles are spent in each rule (this implies RUNTIME_COUNT_RULES)
+//#define RUNTIME_TIME_RULES 1
+
+#if defined(RUNTIME_TIME_RULES) && !defined(RUNTIME_COUNT_RULES)
+#define RUNTIME_COUNT_RULES 1
+#endif
+
 /**
  * @class RuntimeCounter
  * @author Steven Piantadosi
@@ -17,70 +38,91 @@ class RuntimeCounter {
 public:
 	using T = unsigned long;
 
-	// counts of each type of primitive
+	// counts of each rule, indexed by Instruction::rule, and of each builtin that didn't come from a rule, indexed by Op
+	// (these are only used if RUNTIME_COUNT_RULES is defined)
+	std::vector<T> rule_count;
 	std::vector<T> builtin_count;
-	std::vector<T> primitive_count;
+	
+	// and the number of cycles spent in each (only if RUNTIME_TIME_RULES is defined)
+	std::vector<T> rule_cycles;
+	std::vector<T> builtin_cycles;
 
 	T total; // overall count of everything
 
-	// we defaulty initialize these
-	RuntimeCounter() : builtin_count(16,0), primitive_count(16,0), total(0) {	}
+	// NOTE: these start empty (rather than with some zeros) so that creating a VirtualMachineState
+	// does not need to allocate here 
+	RuntimeCounter() : total(0) {	}
+	
+	/**
+	 * @brief Add c to v[i], making v big enough if it isn't
+	 * @param v
+	 * @param i
+	 * @param c
+	 */	
+	static void add(std::vector<T>& v, size_t i, T c) {
+		if(i >= v.size()) v.resize(i+1, 0);
+		v[i] += c;
+	}
 	
 	/**
 	 * @brief Add count number of items to this instruction's count
 	 * @param i
 	 */	
-	void increment(Instruction& i, T count=1) {
-		//CERR ">>" TAB builtin_count.size() TAB primitive_count.size() TAB i TAB this ENDL;
+	void increment(const Instruction& i, T count=1) {
 		total += count;
-//		if(i.is<BuiltinOp>()) {
-//			// this general vector increment lives in miscellaneous
-//			::increment(builtin_count, (size_t)i.as<BuiltinOp>(), (T)count);
-//		}
-//		else {
-//			::increment(primitive_count, (size_t)i.as<PrimitiveOp>(), (T)count);
-//		}
+		#ifdef RUNTIME_COUNT_RULES
+		if(i.rule != Instruction::NO_RULE) add(rule_count, i.rule, count);
+		else                               add(builtin_count, (size_t)i.op, count);
+		#else
+		UNUSED(i);
+		#endif
 	}
-		
+	
+	/**
+	 * @brief Add c cycles to the time spent on i
+	 * @param i
+	 * @param c
+	 */	
+	void add_cycles(const Instruction& i, T c) {
+		if(i.rule != Instruction::NO_RULE) add(rule_cycles, i.rule, c);
+		else                               add(builtin_cycles, (size_t)i.op, c);
+	}
+	
 	/**
 	 * @brief Add the results of another runtime counter
 	 * @param rc
 	 */	
-	void increment(RuntimeCounter& rc) {
-		// we'll go in decreasing order so we don't have to resize each time
-		
-		// FOR NOW: 
+	void increment(const RuntimeCounter& rc) {
 		total += rc.total;
 		
-//		for(size_t i=rc.builtin_count.size()-1; i != 0; i--) {
-//			::increment(builtin_count, i, (T)rc.builtin_count[i]);
-//		}
-//		for(size_t i=rc.primitive_count.size()-1; i != 0; i--) {
-//			::increment(primitive_count, i, (T)rc.primitive_count[i]);
-//		}
+		// we'll go in decreasing order so we don't have to resize each time
+		for(size_t i=rc.rule_count.size();i-- > 0;)     add(rule_count, i, rc.rule_count[i]);
+		for(size_t i=rc.builtin_count.size();i-- > 0;)  add(builtin_count, i, rc.builtin_count[i]);
+		for(size_t i=rc.rule_cycles.size();i-- > 0;)    add(rule_cycles, i, rc.rule_cycles[i]);
+		for(size_t i=rc.builtin_cycles.size();i-- > 0;) add(builtin_cycles, i, rc.builtin_cycles[i]);
+	}
+	
+	/**
+	 * @brief Set everything back to zero (but keep the memory we've allocated)
+	 */	
+	void clear() {
+		total = 0;
+		std::fill(rule_count.begin(), rule_count.end(), 0);
+		std::fill(builtin_count.begin(), builtin_count.end(), 0);
+		std::fill(rule_cycles.begin(), rule_cycles.end(), 0);
+		std::fill(builtin_cycles.begin(), builtin_cycles.end(), 0);
 	}
 		
 	/**
-	 * @brief Retrieve the rule count for a given instruction
+	 * @brief Retrieve the rule count for a given instruction. NOTE: This is always zero unless RUNTIME_COUNT_RULES is defined
 	 * @param i
 	 * @return 
 	 */
-	// retrieve the count corresponding to some grammar rule
-	size_t get(Instruction& i) {
-		throw NotImplementedError();
-//		if(i.is<BuiltinOp>()) {
-//			auto idx = (size_t)i.as<BuiltinOp>();
-//			if(idx >= builtin_count.size()) return 0;
-//			else				     return builtin_count[idx];
-//		}
-//		else {
-//			auto idx = (size_t)i.as<PrimitiveOp>();
-//			if(idx >= primitive_count.size()) return 0;
-//			else				       return primitive_count[idx];
-//		}
+	size_t get(const Instruction& i) const {
+		const auto& v   = (i.rule != Instruction::NO_RULE ? rule_count : builtin_count);
+		const size_t idx = (i.rule != Instruction::NO_RULE ? (size_t)i.rule : (size_t)i.op);
+		return idx < v.size() ? v[idx] : 0;
 	}
-
-	
 	
 	/**
 	 * @brief Display a runtime counter -- NOTE This may not display all zeros if instructions have not been run
@@ -89,19 +131,93 @@ public:
 	std::string string() const {
 		std::string out = "< ";
 		out += str(total);
-//		for(auto& n : builtin_count) {
-//			out += str(n) + " ";
-//		}
-//		out += " : ";
-//		for(auto& n : primitive_count) {
-//			out += str(n) + " ";
-//		}
+		if(not rule_count.empty() or not builtin_count.empty()) {
+			out += " : ";
+			for(auto& n : rule_count) {
+				out += str(n) + " ";
+			}
+			out += ": ";
+			for(auto& n : builtin_count) {
+				out += str(n) + " ";
+			}
+		}
 		out += ">";
 		return out;
 	}
+	
+	/**
+	 * @brief A count of cycles, for timing instructions. 
+	 * @return 
+	 */	
+	static T cycles() {
+		#if defined(__x86_64__) || defined(__i386__)
+		return __rdtsc();
+		#else
+		return std::chrono::duration_cast<std::chrono::nanoseconds>(std::chrono::steady_clock::now().time_since_epoch()).count();
+		#endif
+	}
+	
+	/**
+	 * @brief This thread's profile: everything run by VirtualMachineStates in this thread (when RUNTIME_COUNT_RULES 
+	 * 		  is defined). Each thread adds to its own (so there is no locking when we run).
+	 * @return 
+	 */	
+	static RuntimeCounter& profile();
+	
+	/**
+	 * @brief Add up the profiles from all threads. NOTE: This does not stop other threads from running, so 
+	 * 		  it should be called when they are done (e.g. at the end of a run). 
+	 * @return 
+	 */	
+	static RuntimeCounter profile_total();
 
 };
 
+/**
+ * @brief This keeps track of the profile of every thread, so that profile_total can add them up
+ */
+struct RuntimeProfileRegistry {
+	std::mutex mutex;
+	std::set<RuntimeCounter*> live; // the profiles of threads that are still running
+	RuntimeCounter finished; // what's been added by threads that are done
+	
+	static RuntimeProfileRegistry& get() {
+		static RuntimeProfileRegistry r;
+		return r;
+	}
+	
+	// each thread's profile, which adds itself to live and then to finished when the thread is done
+	struct ThreadProfile {
+		RuntimeCounter rc;
+		ThreadProfile() {
+			auto& r = RuntimeProfileRegistry::get();
+			std::lock_guard g(r.mutex);
+			r.live.insert(&rc);
+		}
+		~ThreadProfile() {
+			auto& r = RuntimeProfileRegistry::get();
+			std::lock_guard g(r.mutex);
+			r.finished.increment(rc);
+			r.live.erase(&rc);
+		}
+	};
+};
+
+RuntimeCounter& RuntimeCounter::profile() {
+	thread_local RuntimeProfileRegistry::ThreadProfile p;
+	return p.rc;
+}
+
+RuntimeCounter RuntimeCounter::profile_total() {
+	auto& r = RuntimeProfileRegistry::get();
+	std::lock_guard g(r.mutex);
+	RuntimeCounter out = r.finished;
+	for(auto rc : r.live) {
+		out.increment(*rc);
+	}
+	return out;
+}
+
 
 
 ///~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~
@@ -0,0 +1,107 @@
+#pragma once
+
+#include <array>
+#include <mutex>
+#include <atomic>
+#include <optional>
+
+#include "MemoTable.h"
+#include "SharedNode.h"
+#include "VirtualMachineControl.h"
+#include "Statistics/FleetStatistics.h"
+
+/**
+ * @class SubtreeCache
+ * @author Steven Piantadosi
+ * @date 18/10/26
+ * @file SubtreeCache.h
+ * @brief A cache of the values (of type T) that deterministic subtrees take on inputs, keyed by the subtree's structural
+ * 		  hash (see Node::hash) and the input. MCMC proposals usually change one subtree and leave the rest alone, so
+ * 		  this lets the unchanged parts of new hypotheses (and hypotheses in other chains or threads) be looked up
+ * 		  instead of run (see Grammar::linearize_cached). It is split into shards, each with its own lock, so that
+ * 		  threads rarely wait on each other. To bound its memory, a shard is emptied once it holds more than its share
+ * 		  of VirtualMachineControl::SUBTREE_CACHE_MAX_ENTRIES. Hits, misses, entries, and (approximate) bytes are counted
+ * 		  in FleetStatistics.
+ * 		  Each entry also stores its subtree as a SharedNode, and a value is only returned for the same subtree (since 
+ * 		  SharedNodes are hash-consed, this just compares pointers). So two subtrees whose hashes collide never get each
+ * 		  other's values; whichever is stored second is just not cached. 
+ */
+template<typename input_t, typename T>
+class SubtreeCache {
+
+	struct Entry {
+		std::optional<SharedNode> subtree; // (optional so that the table's empty slots don't have to make one)
+		T value;
+	};
+
+	using table_t = MemoTable<std::pair<size_t,input_t>,Entry>;
+
+	static constexpr size_t NSHARDS = 64;
+
+	struct alignas(64) Shard {
+		std::mutex lock;
+		table_t    table;
+	};
+	std::array<Shard,NSHARDS> shards;
+
+	Shard& shard(const typename table_t::HashedKey& k) {
+		return shards[(k.hash >> 32) % NSHARDS]; // the table uses the low bits, so we use the high ones here
+	}
+
+public:
+
+	using key_t = typename table_t::HashedKey;
+
+	/**
+	 * @brief The key for a subtree with hash h on input x (this is where x is hashed)
+	 * @param h
+	 * @param x
+	 * @return
+	 */
+	static key_t make_key(size_t h, const input_t& x) {
+		return table_t::make_key(std::make_pair(h, x));
+	}
+
+	/**
+	 * @brief If k is stored for subtree, copy its value into out and return true
+	 * @param k
+	 * @param subtree
+	 * @param out
+	 * @return
+	 */
+	bool find(const key_t& k, const SharedNode& subtree, T& out) {
+		auto& s = shard(k);
+		{
+			std::lock_guard guard(s.lock);
+			if(auto v = s.table.find(k); v != nullptr and v->subtree == subtree) {
+				out = v->value;
+				FleetStatistics::subtree_cache_hits++;
+				return true;
+			}
+		}
+		FleetStatistics::subtree_cache_misses++;
+		return false;
+	}
+
+	/**
+	 * @brief Store v for k and subtree (emptying k's shard first if it is full)
+	 * @param k
+	 * @param subtree
+	 * @param v
+	 */
+	void insert(key_t&& k, const SharedNode& subtree, const T& v) {
+		auto& s = shard(k);
+		std::lock_guard guard(s.lock);
+
+		const size_t old_size = s.table.size();
+		const size_t old_bytes = s.table.memory();
+
+		if(old_size >= std::max<size_t>(1, VirtualMachineControl::SUBTREE_CACHE_MAX_ENTRIES / NSHARDS)) {
+			s.table.clear();
+		}
+		s.table.emplace(std::move(k), Entry{subtree, v});
+
+		FleetStatistics::subtree_cache_entries += s.table.size() - old_size; // (this wraps around when we clear, which is what we want)
+		FleetStatistics::subtree_cache_bytes   += s.table.memory() - old_bytes;
+	}
+};
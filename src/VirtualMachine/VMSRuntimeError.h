@@ -8,6 +8,7 @@
  * @date 03/02/20
  * @file Instruction.h
  * @brief This is an error type that is returned if we get a runtime error (e.g. string length, etc.)
- * 		  and it is handled in VMS
+ * 		  and it is handled in VMS. Because throwing is slow, primitives can instead set the VMS's status to 
+ * 		  vmstatus_t::ERROR (and functions given to Grammar::add can return an empty std::optional).
  */
 class VMSRuntimeError : public std::exception {};
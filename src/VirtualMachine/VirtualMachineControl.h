@@ -22,6 +22,35 @@ struct VirtualMachineControl {
 	// what is the longest I'll run a single program for? If we try to do more than this many ops, we're done
 	static unsigned long MAX_RUN_PROGRAM; 
 	
+	// should DeterministicLOTHypothesis compile programs into closures (see Closure.h) when it can, 
+	// instead of running them on a VirtualMachineState? This is off by default, since a closure reports errors 
+	// by throwing (which is slow when programs hit many errors) and doesn't count If's jumps as instructions
+	static bool USE_CLOSURES;
+	
+	// compiling a closure costs about as much as running a program this many times (see Testing/Closures), 
+	// so a hypothesis only compiles one after it has been called this many times
+	static unsigned long CLOSURE_AFTER_CALLS;
+	
+	// should LOTHypothesis::compile replace subtrees that don't depend on the input with their values? 
+	// (see Grammar::linearize_folded) This is off by default, since it assumes primitives are pure and changes
+	// program sizes (and so what MAX_RUN_PROGRAM allows)
+	static bool FOLD_CONSTANTS;
+	
+	// should recursions in tail position reuse their caller's frame? (see VirtualMachineState::tail_recurse)
+	static bool TAIL_CALLS;
+	
+	// should DeterministicLOTHypothesis keep what MemRecurse memoized from one call to the next (until it is 
+	// recompiled), instead of starting each call with an empty memo? This changes results when MAX_RECURSE matters, 
+	// since calls that were memoized earlier no longer count towards it
+	static bool PERSISTENT_MEMO;
+	
+	// should LOTHypothesis::compile look up deterministic subtrees that use the input in a SubtreeCache, shared by all
+	// hypotheses, instead of always running them? (see Grammar::linearize_cached) Only subtrees with at least 
+	// SUBTREE_CACHE_MIN_NODES nodes are cached, and each SubtreeCache stores about SUBTREE_CACHE_MAX_ENTRIES values
+	static bool SUBTREE_CACHE;
+	static unsigned long SUBTREE_CACHE_MIN_NODES;
+	static unsigned long SUBTREE_CACHE_MAX_ENTRIES;
+	
 	///////////////////////////////////////
 	// Variables for VirtualMachinePool
 	///////////////////////////////////////
@@ -35,6 +64,17 @@ struct VirtualMachineControl {
 	// prune VirtualMachineStates with less than this log probability
 	static double MIN_LP;
 	
+	// how many threads does a VirtualMachinePool use to run states? (1 means it runs them in serial)
+	static unsigned long POOL_THREADS;
+	
+	// a VirtualMachinePool only starts using its threads once it has this many states queued (before that, there is 
+	// too little to share and handing states to threads costs more than running them)
+	static unsigned long POOL_PARALLEL_QUEUE;
+	
+	// a VirtualMachinePool stops once the probability mass (not log) of the states it hasn't run is below this. 
+	// 0 means we don't stop for this
+	static double MASS_TOLERANCE;
+	
 	// count up how often we break for different reasons (useful for seeing what bounds matter)
 //	static unsigned long BREAK_output;
 //	static unsigned long BREAK_steps;
@@ -46,10 +86,21 @@ struct VirtualMachineControl {
 // The defaults:
 unsigned long VirtualMachineControl::MAX_RECURSE = 64;
 unsigned long VirtualMachineControl::MAX_RUN_PROGRAM = 10000; // updated to have higher default
+bool VirtualMachineControl::USE_CLOSURES = false;
+unsigned long VirtualMachineControl::CLOSURE_AFTER_CALLS = 16;
+bool VirtualMachineControl::FOLD_CONSTANTS = false;
+bool VirtualMachineControl::TAIL_CALLS = true;
+bool VirtualMachineControl::PERSISTENT_MEMO = false;
+bool VirtualMachineControl::SUBTREE_CACHE = false;
+unsigned long VirtualMachineControl::SUBTREE_CACHE_MIN_NODES = 8;
+unsigned long VirtualMachineControl::SUBTREE_CACHE_MAX_ENTRIES = 1<<20;
 
 unsigned long VirtualMachineControl::MAX_STEPS = 512;
 unsigned long VirtualMachineControl::MAX_OUTPUTS = 512;
 double VirtualMachineControl::MIN_LP = -10;
+unsigned long VirtualMachineControl::POOL_THREADS = 1;
+unsigned long VirtualMachineControl::POOL_PARALLEL_QUEUE = 16;
+double VirtualMachineControl::MASS_TOLERANCE = 0.0;
 
 //unsigned long VirtualMachineControl::BREAK_output = 0;
 //unsigned long VirtualMachineControl::BREAK_steps = 0;
@@ -2,9 +2,13 @@
 
 #include "DiscreteDistribution.h"
 #include "VirtualMachineControl.h"
+#include "Random.h"
+#include "WorkerPool.h"
 
 #include <vector>
 #include <queue>
+#include <mutex>
+#include <condition_variable>
 
 
 /**
@@ -37,6 +41,10 @@ DiscreteDistribution<typename VirtualMachineState_t::output_t>  marginal_vms_out
  * 			if it encounters a random flip
  * 			This stores pointers because it is impossible to copy out of std collections, so we are constantly
  * 			having to call VirtualMachineState constructors. Using pointers speeds us up by about 20%.
+ * 			If VirtualMachineControl::POOL_THREADS > 1 (and the hardware has more than one thread), once Q has 
+ * 			POOL_PARALLEL_QUEUE states in it, run() uses that many threads (from WorkerPool, so they are not started on
+ * 			each run), each of which pops the best state, runs it, and pushes its branches back. This is only worth it when single calls are expensive (e.g. wide 
+ * 			stochastic branching). 
  */
 template<typename VirtualMachineState_t>
 class VirtualMachinePool : public VirtualMachineControl {
@@ -63,32 +71,134 @@ public:
 	double worst_lp;
 	unsigned long total_instruction_count;
 	
+	// How much probability mass (not log) is in the states in Q? This is what we haven't explored yet.
+	double queued_mass; 
+	
+	// After run, this is an upper bound on the probability mass of execution paths whose output we don't know
+	// (those still in Q, plus those that were pruned). So the probability of any output is between out[o] and 
+	// out[o]+missing_mass.
+	double missing_mass; 
+	
+	// In sampling mode (see sample), each state in Q is a single forward sample, so at a random choice we pick one
+	// of the alternatives (with probability proportional to exp(lpinc)) instead of keeping all of them. While the choice
+	// is being made, chosen is the copy for the alternative we have picked so far (or nullptr if it is the running state
+	// or we haven't picked any) and chosen_z is the total weight of alternatives we've seen. 
+	bool sampling; 
+	VirtualMachineState_t* chosen;
+	double chosen_z;
+	
 	std::priority_queue<VirtualMachineState_t*, std::vector<VirtualMachineState_t*>, VirtualMachinePool::compare_VirtualMachineState_t_prt> Q; // Q of states sorted by probability
 	//std::priority_queue<VirtualMachineState_t*, ReservedVector<VirtualMachineState_t*,16>, VirtualMachinePool::compare_VirtualMachineState_t_prt> Q; // Does not seem to speed things up 
 
-	VirtualMachinePool() : total_vms_steps(0), worst_lp(infinity), total_instruction_count(0) { 
+	// States we are done with are kept here (rather than deleted) so that we can reuse them and the memory
+	// in their stacks. This means that once a pool has been running for a while, it rarely needs to allocate.
+	std::vector<VirtualMachineState_t*> spare;
+
+	// When we run in parallel, everything that touches Q, spare, or the counts above must hold mutex. 
+	// We don't lock at all when we run in serial. 
+	bool parallel; 
+	std::mutex mutex;
+	std::condition_variable cv; 
+
+	VirtualMachinePool() : total_vms_steps(0), worst_lp(infinity), total_instruction_count(0), 
+						   queued_mass(0.0), missing_mass(0.0), sampling(false), chosen(nullptr), chosen_z(0.0), parallel(false) { 
 	}
 	
+	VirtualMachinePool(const VirtualMachinePool&) = delete; // states store pointers back to their pool 
 
 	virtual ~VirtualMachinePool() {
 		clear();
+		for(auto vms : spare) {
+			delete vms;
+		}
 	}
 	
 	/**
-	 * @brief Remove everything and reset my values
+	 * @brief Remove everything and reset my values. This keeps the states that were in Q to reuse later.
 	 */	
 	virtual void clear() {
 		while(not Q.empty()) {
-			VirtualMachineState_t* vms = Q.top(); Q.pop();
-			delete vms; 
+			recycle(pop_best()); 
+		}
+		
+		if(chosen != nullptr) { // in case something threw while sampling
+			recycle(chosen);
+			chosen = nullptr;
 		}
+		chosen_z = 0.0;
 		
 		total_vms_steps = 0;
 		worst_lp = infinity;
+		total_instruction_count = 0;
+		queued_mass = 0.0;
+		missing_mass = 0.0;
+	}
+	
+	/**
+	 * @brief Make a new state that starts running on input x (reusing an old one if we can). This
+	 * 		  is the same as new VirtualMachineState_t(x,err,this) 
+	 * @param x
+	 * @param err
+	 * @return 
+	 */	
+	VirtualMachineState_t* make(const input_t& x, const output_t& err) {
+		auto vms = take_spare();
+		if(vms == nullptr) {
+			return new VirtualMachineState_t(x, err, this);
+		}
+		else {
+			vms->reset(x, err, this);
+			return vms;
+		}
+	}
+	
+	/**
+	 * @brief Make a copy of x (reusing an old state if we can)
+	 * @param x
+	 * @return 
+	 */
+	VirtualMachineState_t* make_copy(const VirtualMachineState_t* x) {
+		auto vms = take_spare();
+		if(vms == nullptr) {
+			return new VirtualMachineState_t(*x);
+		}
+		else {
+			*vms = *x;
+			return vms;
+		}
+	}
+	
+	/**
+	 * @brief We are done with vms, so hold onto it for make or make_copy. (This is instead of delete)
+	 * @param vms
+	 */	
+	void recycle(VirtualMachineState_t* vms) {
+		auto g = guard();
+		spare.push_back(vms);
+	}
+	
+	/**
+	 * @brief Remove and return one of the spare states, or nullptr if there aren't any
+	 * @return 
+	 */	
+	VirtualMachineState_t* take_spare() {
+		auto g = guard();
+		if(spare.empty()) return nullptr;
+		auto vms = spare.back(); spare.pop_back();
+		return vms;
+	}
+	
+	/**
+	 * @brief Lock mutex, but only if we are running in parallel.
+	 * @return 
+	 */	
+	std::unique_lock<std::mutex> guard() {
+		return parallel ? std::unique_lock<std::mutex>(mutex) : std::unique_lock<std::mutex>();
 	}
 	
 	/**
 	 * @brief Returns true if I would add something with this lp, given my MAX_STEPS and the stack. This lets us speed up by checking if we would add before copying/constructing a VMS
+	 * 		  NOTE: In parallel, the caller must hold mutex.
 	 * @param lp
 	 * @return 
 	 */
@@ -100,15 +210,18 @@ public:
 	}
 	
 	/**
-	 * @brief Add the VirtualMachineState_t o to this pool (but again checking if I'd add)
+	 * @brief Add the VirtualMachineState_t o to this pool (but again checking if I'd add). If we don't add it, 
+	 * 		  it is recycled.
 	 * @param o
 	 */
 	void push(VirtualMachineState_t* o) { 
+		auto g = guard();
 		if(wouldIadd(o->lp)){ // TODO: might be able to add an optimization here that doesn't push if we don't have enough steps left to get it 
-			Q.push(o);			
-			worst_lp = std::min(worst_lp, o->lp); //keep track of the worst we've seen
+			requeue(o);
 		} 
-		// else nothing 
+		else {
+			spare.push_back(o);
+		}
 	}
 	
 	/**
@@ -122,19 +235,36 @@ public:
 	 */	
 	template<typename T>
 	bool copy_increment_push(const VirtualMachineState_t* x, T v, double lpinc) {
-		if(wouldIadd(x->lp + lpinc)) {	
-			assert(x->status == vmstatus_t::GOOD);
-			auto s = new VirtualMachineState_t(*x); // copy
-			s->template push<T>(v); // add v
-			s->lp += lpinc;
-			this->push(s);	
-			return true;
-		}	
-		return false;
+		if(sampling) {
+			// we always return true so that the builtin shows us every alternative
+			if(choose(lpinc)) {
+				assert(x->status == vmstatus_t::GOOD);
+				if(chosen == nullptr) chosen = make_copy(x);
+				else                  *chosen = *x;
+				chosen->template push<T>(v);
+				chosen->lp += lpinc;
+			}
+			return true; 
+		}
+		
+		{
+			auto g = guard();
+			if(not wouldIadd(x->lp + lpinc)) return false;
+		}
+		
+		assert(x->status == vmstatus_t::GOOD);
+		auto s = make_copy(x); // copy outside of the lock so that threads can copy at the same time
+		s->template push<T>(v); // add v
+		s->lp += lpinc;
+		this->push(s);	
+		return true;
 	}
 	
 	/**
-	 * @brief Same as copy_increment_push, but does not make a copy -- just add
+	 * @brief Same as copy_increment_push, but does not make a copy -- just add. 
+	 * 		  NOTE: s is not put back into Q here; since s is the state that is currently running, it is put back
+	 * 		  by run() once s stops (the builtins tell it to by setting s->status to RANDOM_CHOICE_NO_DELETE when this returns true).
+	 * 		  This way, no other thread can start running s before it has stopped. 
 	 * @param s
 	 * @param v
 	 * @param lpinc
@@ -142,32 +272,123 @@ public:
 	 */
 	template<typename T>
 	bool increment_push(VirtualMachineState_t* s, T v, double lpinc) {		
-		if(wouldIadd(s->lp + lpinc)) {		
-			assert(s->status == vmstatus_t::GOOD);
-			s->template push<T>(v); // add this
-			s->lp += lpinc;
-			this->push(s);	
-			return true;
-		}	
-		return false;
+		if(sampling) {
+			// NOTE: the builtins call this after copy_increment_push for all of the other alternatives, so
+			// s is the last alternative and we can decide now whether it is the one we keep
+			if(not choose(lpinc)) return false; 
+			if(chosen != nullptr) {
+				spare.push_back(chosen);
+				chosen = nullptr; 
+			}
+		}
+		else {
+			auto g = guard();
+			if(not wouldIadd(s->lp + lpinc)) return false;
+		}
+		
+		assert(s->status == vmstatus_t::GOOD);
+		s->template push<T>(v); // add this
+		s->lp += lpinc;
+		return true;
+	}
+	
+	/**
+	 * @brief Put o into Q without checking wouldIadd. NOTE: In parallel, the caller must hold mutex.
+	 * @param o
+	 */	
+	void requeue(VirtualMachineState_t* o) {
+		Q.push(o);			
+		worst_lp = std::min(worst_lp, o->lp); //keep track of the worst we've seen
+		queued_mass += exp(o->lp);
+		if(parallel) cv.notify_one();
+	}
+	
+	/**
+	 * @brief Remove and return the highest probability state in Q. NOTE: In parallel, the caller must hold mutex.
+	 * @return 
+	 */	
+	VirtualMachineState_t* pop_best() {
+		VirtualMachineState_t* vms = Q.top(); Q.pop();
+		queued_mass = (Q.empty() ? 0.0 : std::max(0.0, queued_mass - exp(vms->lp))); // avoid accumulating numerical error
+		return vms;
+	}
+	
+	/**
+	 * @brief Should run keep going, given how much mass is left in Q (plus running, the mass of states that are 
+	 * 		  being run and so might still add to Q) and the tolerance? 
+	 * @param tolerance
+	 * @param running
+	 * @return 
+	 */	
+	bool enough_mass(double tolerance, double running=0.0) const {
+		return tolerance <= 0.0 or queued_mass + running > tolerance;
+	}
+	
+	/**
+	 * @brief In sampling mode, we see the alternatives of a random choice one at a time. This decides whether
+	 * 		  to keep the one we are seeing now (with log probability lpinc) instead of the one we have kept so far, 
+	 * 		  so that in the end each is kept with probability proportional to exp(lpinc).
+	 * @param lpinc
+	 * @return 
+	 */	
+	bool choose(double lpinc) {
+		const double w = exp(lpinc);
+		if(not (w > 0.0)) return false; // can't ever choose this one
+		chosen_z += w;
+		return uniform()*chosen_z < w; 
+	}
+	
+	/**
+	 * @brief After running vms, either put it back into Q (if it stopped at a random choice and increment_push kept it)
+	 * 		  or recycle it. NOTE: In parallel, the caller must hold mutex.
+	 * @param vms
+	 */	
+	void finish(VirtualMachineState_t* vms) {
+		// not else if because we need to delete complete ones too
+		if(vms->status != vmstatus_t::RANDOM_CHOICE_NO_DELETE) {
+			total_instruction_count += vms->runtime_counter.total; /// HMM Do we want to count these too? I guess since its called "total"....
+			spare.push_back(vms); // if our previous copy isn't pushed back on the stack, we can reuse it
+		} 
+		else {
+			// else restore to running order when we're RANDOM_CHOICE_NO_DELETE so it keeps running
+			vms->status = vmstatus_t::GOOD;
+			requeue(vms);
+		}
+		
+		// when sampling, a random choice may have picked one of the copies 
+		if(chosen != nullptr) {
+			requeue(chosen);
+			chosen = nullptr;
+		}
+		chosen_z = 0.0;
 	}
 
 	/**
 	 * @brief This runs and adds up the probability mass for everything, returning a dictionary outcomes->log_probabilities. This is the main 
 	 * 		  running loop, which pops frmo the top of our queue, runs, and continues until we've done enough or all. 
 	 * 		  Note that objects lower than min_lp are not ever pushed onto the queue.
-	 * @param dispatcher
-	 * @param loader
+	 * 		  If tolerance > 0, we also stop once the mass left in Q is at most tolerance. Either way, afterwards missing_mass
+	 * 		  bounds how much probability mass is not in the returned distribution. 
+	 * @param tolerance
 	 * @return 
 	 */
-	DiscreteDistribution<output_t> run() { 
+	DiscreteDistribution<output_t> run(double tolerance=MASS_TOLERANCE) { 
 
 		DiscreteDistribution<output_t> out;
 		
+		const double start_mass = queued_mass;
+		double finished_mass = 0.0; // mass of the paths that completed or errored 
+		
 		total_vms_steps = 0;
-		while(total_vms_steps < MAX_STEPS && out.size() < MAX_OUTPUTS && !Q.empty()) {
+		while(total_vms_steps < MAX_STEPS && out.size() < MAX_OUTPUTS && !Q.empty() && enough_mass(tolerance)) {
+			
+			// once there are enough states to keep several threads busy, run the rest in parallel
+			if(Q.size() >= POOL_PARALLEL_QUEUE and WorkerPool::concurrency(POOL_THREADS) > 1) {
+				run_parallel(out, finished_mass, tolerance);
+				break;
+			}
 			
-			VirtualMachineState_t* vms = Q.top(); Q.pop();
+			VirtualMachineState_t* vms = pop_best();
 			assert(vms->status == vmstatus_t::GOOD);
 			
 			// if we ever go back to the non-pointer version, we might need fanciness to move out of top https://stackoverflow.com/questions/20149471/move-out-element-of-std-priority-queue-in-c11
@@ -182,23 +403,149 @@ public:
 				out.addmass(y, vms->lp);
 				total_instruction_count += vms->runtime_counter.total;
 			}
-			
-			// not else if because we need to delete complete ones too
-			if(vms->status != vmstatus_t::RANDOM_CHOICE_NO_DELETE) {
-				total_instruction_count += vms->runtime_counter.total; /// HMM Do we want to count these too? I guess since its called "total"....
-				delete vms; // if our previous copy isn't pushed back on the stack, delete it
-			} 
-			else {
-				// else restore to running order when we're RANDOM_CHOICE_NO_DELETE so it keeps running
-				vms->status = vmstatus_t::GOOD;
+			if(vms->status == vmstatus_t::COMPLETE or vms->status == vmstatus_t::ERROR) {
+				finished_mass += exp(vms->lp);
 			}
+			
+			finish(vms);
 		}
+		
+		missing_mass = std::max(0.0, start_mass - finished_mass);
 
 		// this leaves some in the stack, but they are cleaned up by the destructor
 		// (this way we can resume running if we want to)
 		return out;		
 	}
 	
+	/**
+	 * @brief Run until the probability mass left in Q is at most tolerance (or we hit MAX_STEPS or MAX_OUTPUTS), 
+	 * 		  and return the distribution on outputs along with a bound on the probability mass that is missing 
+	 * 		  from it (see missing_mass). 
+	 * @param tolerance
+	 * @return 
+	 */	
+	std::pair<DiscreteDistribution<output_t>, double> run_bounded(double tolerance) {
+		auto out = run(tolerance);
+		return {out, missing_mass};
+	}
+	
+	
+	/**
+	 * @brief Instead of enumerating execution paths, run n forward samples starting from start, where each random choice
+	 * 		  is drawn instead of branched. The returned distribution has log probability log(k/n) for an output that 
+	 * 		  k samples produced, and afterwards missing_mass is the fraction of samples that did not complete (errors or
+	 * 		  MAX_STEPS, which here is per sample). This pool keeps start, and it is recycled at the end. 
+	 * 		  NOTE: This is always run in serial; to use threads, run separate pools (see StochasticLOTHypothesis::call_sampled).
+	 * @param start
+	 * @param n
+	 * @return 
+	 */	
+	DiscreteDistribution<output_t> sample(VirtualMachineState_t* start, size_t n) {
+		assert(Q.empty() and chosen == nullptr);
+		
+		DiscreteDistribution<output_t> out;
+		
+		const double lpn = -log(n);
+		size_t ncomplete = 0;
+		
+		total_vms_steps = 0;
+		sampling = true; 
+		for(size_t i=0;i<n;i++) {
+			requeue(make_copy(start));
+			
+			// now Q only ever has one state in it -- the one this sample is running
+			size_t steps = 0;
+			while(not Q.empty()) {
+				VirtualMachineState_t* vms = pop_best();
+				
+				if(steps++ >= MAX_STEPS) {
+					spare.push_back(vms);
+					break; 
+				}
+				
+				total_vms_steps++;
+				auto y = vms->run();
+				
+				if(vms->status == vmstatus_t::COMPLETE) { // can't add up probability for errors
+					out.addmass(y, lpn);
+					total_instruction_count += vms->runtime_counter.total;
+					ncomplete++;
+				}
+				
+				finish(vms);
+			}
+		}
+		sampling = false;
+		
+		recycle(start);
+		missing_mass = 1.0 - double(ncomplete)/n;
+		
+		return out;
+	}
+	
+	/**
+	 * @brief The rest of run(), using up to POOL_THREADS threads. Each one takes the highest probability state, runs it 
+	 * 		  without holding the lock (so its random choices can push new states), and then adds its output to out
+	 * 		  (and its mass to finished_mass). We stop when we hit MAX_STEPS or MAX_OUTPUTS, when Q is empty and nothing
+	 * 		  is running (that could add to it), or when the mass in Q and running is below tolerance.
+	 * 		  A state's memoized values may be shared with states that other threads run, so each thread makes its own
+	 * 		  copy of them when it takes a state (see CopyOnWrite::unshare). 
+	 * 		  NOTE: Because threads finish in different orders, which states are run near the budgets can differ between runs. 
+	 * @param out
+	 * @param finished_mass
+	 * @param tolerance
+	 */	
+	void run_parallel(DiscreteDistribution<output_t>& out, double& finished_mass, double tolerance) {
+		
+		parallel = true; 
+		
+		size_t running = 0; // how many threads are running a state?
+		double running_mass = 0.0; // and how much mass do they have? 
+		bool done = false; 
+		
+		WorkerPool::instance().run(POOL_THREADS, [&](size_t) {
+			std::unique_lock<std::mutex> g(mutex);
+			while(true) {
+				cv.wait(g, [&]() { return done or (not Q.empty()) or running == 0; });
+				
+				if(done or total_vms_steps >= MAX_STEPS or out.size() >= MAX_OUTPUTS or (Q.empty() and running == 0) or (not enough_mass(tolerance, running_mass))) {
+					done = true;
+					cv.notify_all();
+					return;
+				}
+				
+				VirtualMachineState_t* vms = pop_best();
+				assert(vms->status == vmstatus_t::GOOD);
+				assert(vms->lp >= MIN_LP);
+				
+				total_vms_steps++;
+				running++;
+				const double m = exp(vms->lp); // lp may change while it runs
+				running_mass += m;
+				
+				g.unlock();
+				vms->unshare_memo();
+				auto y = vms->run();
+				g.lock();
+				
+				running--;
+				running_mass = (running == 0 ? 0.0 : running_mass - m);
+				
+				if(vms->status == vmstatus_t::COMPLETE) { // can't add up probability for errors
+					out.addmass(y, vms->lp);
+					total_instruction_count += vms->runtime_counter.total;
+				}
+				if(vms->status == vmstatus_t::COMPLETE or vms->status == vmstatus_t::ERROR) {
+					finished_mass += exp(vms->lp);
+				}
+				
+				finish(vms);
+				cv.notify_all(); // others may be waiting on running == 0
+			}
+		});
+		
+		parallel = false; 
+	}
 	
 	/**
 	 * @brief Run but return a vector of completed virtual machines instead of marginalizing outputs. 
@@ -214,7 +561,7 @@ public:
 		total_vms_steps = 0;
 		while(total_vms_steps < MAX_STEPS && !Q.empty()) {
 			
-			VirtualMachineState_t* vms = Q.top(); Q.pop();
+			VirtualMachineState_t* vms = pop_best();
 			assert(vms->status == vmstatus_t::GOOD);
 			assert(vms->lp >= MIN_LP);
 			
@@ -227,14 +574,7 @@ public:
 				total_instruction_count += vms->runtime_counter.total; 
 			}
 			
-			if(vms->status != vmstatus_t::RANDOM_CHOICE_NO_DELETE) { 
-				total_instruction_count += vms->runtime_counter.total; 
-				delete vms; // if our previous copy isn't pushed back on the stack, delete it
-			}
-			else {
-				// else restore to running order
-				vms->status = vmstatus_t::GOOD;
-			}
+			finish(vms);
 		}
 
 		return out;		
@@ -8,7 +8,9 @@
 
 #include "Errors.h"
 #include "Program.h"
-#include "Stack.h"
+#include "SmallStack.h"
+#include "CopyOnWrite.h"
+#include "MemoTable.h"
 #include "Statistics/FleetStatistics.h"
 #include "RuntimeCounter.h"
 #include "VirtualMachineControl.h"
@@ -21,6 +23,18 @@
 // helps to find it 
 //#define NO_CHECK_END_STACK_SIZE 1 
 
+// if defined, run() calls every instruction through its std::function, rather than handling the 
+// builtin control and boolean Ops (X, If, Jmp, PopX, And, Or, ...) directly inside the interpreter loop. 
+// This is mainly useful for debugging the versions in Builtins.h, which must have the same behavior
+//#define NO_DIRECT_DISPATCH 1
+
+// How many bytes each stack in a VirtualMachineState stores inside the object itself, before it has to 
+// allocate. Larger values mean that more programs can run without allocating, but make VirtualMachineStates 
+// bigger to copy around (only the used part of each stack is copied though)
+#ifndef VMS_STACK_INLINE_BYTES
+	#define VMS_STACK_INLINE_BYTES 128
+#endif 
+
 // These are the only types of classes we are able to memoize in a lexicon
 // NOTE: We need short because that's the "key" used for LOTHypothesis instead of lexicon
 #define LEXICON_MEMOIZATION_TYPES  short,std::string,int 
@@ -55,16 +69,18 @@ public:
 	// This is read a few other places, like in Builtins
 	using FT = std::function<void(this_t*,int)>;
 
-	// what we use internally for stacks
+	// what we use internally for stacks -- these store a few elements inline so that making 
+	// and copying VirtualMachineStates usually doesn't need to allocate 
 	template<typename T>
-	using VMSStack = Stack<T>;
+	using VMSStack = SmallStack<T, std::max<size_t>(2, VMS_STACK_INLINE_BYTES/sizeof(T))>;
 		
-	Program<this_t>    program; // programs are instructions for myself
+	ProgramStack<this_t> program; // programs are instructions for myself
 	VMSStack<input_t>  xstack; //xstackthis stores a stack of the x values (for recursive calls)
-	const output_t&    err; // what error output do we return? Just a reference to a value for speed
+	const output_t*    err; // what error output do we return? Just a pointer to a value for speed (a pointer so that we can be assigned)
 	double             lp; // the probability of this context
 	
 	unsigned long 	  recursion_depth; // when I was created, what was my depth?
+	bool              tail_call; // was the instruction we are running in tail position? (see Program::mark_tail_calls)
 	
 private:
 	// these are private and should only be accessed via stack(), mem(), memstack() below
@@ -76,16 +92,27 @@ private:
 	stack_t<VM_TYPES...> _stack; // our stacks of different types
 	
 	// same for defining memoization types -- here these are the only ones we allow
+	// These are copy-on-write so that branching a VirtualMachineState shares them until a branch memoizes something new
+	template<typename T>
+	using memmap_t = MemoTable<std::pair<T,input_t>,output_t>;
+	
 	template<typename... args>
-	struct mem_t { std::tuple<std::map<std::pair<args,input_t>,output_t>...> value; };
+	struct mem_t { std::tuple<CopyOnWrite<memmap_t<args>>...> value; };
 	mem_t<LEXICON_MEMOIZATION_TYPES> _mem;
 	
 	template<typename... args>
-	struct memstack_t { std::tuple< VMSStack<std::pair<args, input_t>>...> value; };
+	struct memstack_t { std::tuple< VMSStack<typename memmap_t<args>::HashedKey>...> value; };
 	memstack_t<LEXICON_MEMOIZATION_TYPES> _memstack;
 
 public:
 
+	// the key (with its hash) for memoizing calls with key type T 
+	template<typename T>
+	using memkey_t = typename memmap_t<T>::HashedKey;
+	
+	// all of the memoized values, which a hypothesis can keep between calls (see swap_memo)
+	using memo_t = mem_t<LEXICON_MEMOIZATION_TYPES>;
+
 	vmstatus_t status; // are we still running? Did we get an error?
 	
 	// what do we use to count up instructions 
@@ -97,15 +124,87 @@ public:
 	VirtualMachinePool<this_t>* pool;
 	
 	VirtualMachineState(input_t x, const output_t& e, VirtualMachinePool<this_t>* po) :
-		err(e), lp(0.0), recursion_depth(0), status(vmstatus_t::GOOD), pool(po) {
+		err(&e), lp(0.0), recursion_depth(0), tail_call(false), status(vmstatus_t::GOOD), pool(po) {
 		xstack.push(x);	
 	}
 	
+	/**
+	 * @brief Put this back into the state it would have after construction, but keeping any memory our stacks 
+	 * 		  have already allocated. This is used by VirtualMachinePool to recycle states. 
+	 * @param x
+	 * @param e
+	 * @param po
+	 */	
+	void reset(input_t x, const output_t& e, VirtualMachinePool<this_t>* po) {
+		program.clear();
+		program.loader = nullptr;
+		xstack.clear();
+		std::apply([](auto&... st) { (st.clear(), ...); }, _stack.value);
+		std::apply([](auto&... m)  { (m.clear(), ...); },  _mem.value);
+		std::apply([](auto&... st) { (st.clear(), ...); }, _memstack.value);
+		err = &e;
+		lp = 0.0;
+		recursion_depth = 0;
+		tail_call = false;
+		status = vmstatus_t::GOOD;
+		runtime_counter.clear();
+		pool = po;
+		xstack.push(x);
+	}
+	
+	/**
+	 * @brief Make sure our stacks are big enough to run p without allocating again, using the 
+	 * 		  stack depths that were computed when p was compiled. 
+	 * @param p
+	 */
+	void reserve(const Program<this_t>& p) {
+		(stack<VM_TYPES>().reserve(p.stack_depth(TypeIndex<VM_TYPES, std::tuple<VM_TYPES...>>::value)), ...);
+	}
+	
+	/**
+	 * @brief The memoized values for key type T. This is read-only because the map may be shared with other
+	 * 		  VirtualMachineStates -- use writable_mem to change it. 
+	 * @return 
+	 */	
+	template<typename T>
+	const memmap_t<T>& mem() const { return std::get<CopyOnWrite<memmap_t<T>>>(_mem.value).get(); }
+	
+	/**
+	 * @brief A modifiable version of mem (which makes our own copy first, if it is shared)
+	 * @return 
+	 */	
 	template<typename T>
-	std::map<std::pair<T,input_t>,output_t>& mem() { return std::get<std::map<std::pair<T,input_t>,output_t>>(_mem.value); }
+	memmap_t<T>& writable_mem() { return std::get<CopyOnWrite<memmap_t<T>>>(_mem.value).modify(); }
  
+	/**
+	 * @brief Make the key for memoizing a call to k with argument x (this is where its hash is computed)
+	 * @param k
+	 * @param x
+	 * @return 
+	 */	
 	template<typename T>
-	VMSStack<std::pair<T,input_t>>& memstack() { return std::get<VMSStack<std::pair<T,input_t>>>(_memstack.value); }
+	static memkey_t<T> make_memkey(T k, const input_t& x) {
+		return memmap_t<T>::make_key(std::make_pair(std::move(k), x));
+	}
+	
+	template<typename T>
+	VMSStack<memkey_t<T>>& memstack() { return std::get<VMSStack<memkey_t<T>>>(_memstack.value); }
+	
+	/**
+	 * @brief Make our own copies of any memoized values we share with other states (see CopyOnWrite::unshare)
+	 */
+	void unshare_memo() {
+		std::apply([](auto&... m) { (m.unshare(), ...); }, _mem.value);
+	}
+	
+	/**
+	 * @brief Exchange our memoized values with m. DeterministicLOTHypothesis uses this to keep them between calls 
+	 * 		  (see VirtualMachineControl::PERSISTENT_MEMO). This only swaps pointers. 
+	 * @param m
+	 */	
+	void swap_memo(memo_t& m) {
+		std::swap(_mem, m);
+	}
 	
 	/**
 	 * @brief These must be sortable by lp so that we can enumerate them from low to high probability in a VirtualMachinePool 
@@ -219,7 +318,7 @@ public:
 	output_t get_output() {
 		
 		if(status == vmstatus_t::ERROR) 
-			return err;		
+			return *err;		
 		
 		assert(status == vmstatus_t::COMPLETE && "*** Probably should not be calling this unless we are complete");
 		
@@ -230,6 +329,135 @@ public:
 		return gettop<output_t>();
 	}
 	
+	/**
+	 * @brief Execute the builtin Ops directly here (which gcc compiles to a jump table) so that the most common 
+	 * 		  instructions don't have to go through the std::function stored in i.f. These must match the 
+	 * 		  behavior of the versions in Builtins.h. Ops whose meaning depends on which Builtin made them 
+	 *        (e.g. Op::Recurse, Op::Sample) or which need a pool are not handled here. 
+	 * @param i
+	 * @return Returns true if i was run here; false means the caller must call i.f
+	 */
+	inline bool dispatch_builtin(const Instruction& i) {
+		
+		switch(i.op) {
+			case Op::Standard: 
+				return false; 
+				
+			case Op::X:
+				if constexpr (contains_type<input_t,VM_TYPES...>()) {
+					assert(not xstack.empty());
+					stack<input_t>().push(xstack.top()); // not a pop!
+					return true;
+				}
+				else return false;
+				
+			case Op::If:
+				if constexpr (contains_type<bool,VM_TYPES...>()) {
+					if(not getpop<bool>()) program.popn(i.arg); // skip the x branch 
+					return true;
+				}
+				else return false;
+				
+			case Op::Jmp:
+				program.popn(i.arg);
+				return true;
+				
+			case Op::PopX:
+				xstack.pop();
+				return true;
+				
+			case Op::NoOp:
+				return true;
+				
+			case Op::And:
+				if constexpr (contains_type<bool,VM_TYPES...>()) {
+					if(not getpop<bool>()) { 
+						program.popn(i.arg); // pop off the other branch 
+						stack<bool>().push(false); 
+					}
+					return true;
+				}
+				else return false;
+				
+			case Op::Or:
+				if constexpr (contains_type<bool,VM_TYPES...>()) {
+					if(getpop<bool>()) { 
+						program.popn(i.arg); 
+						stack<bool>().push(true); 
+					}
+					return true;
+				}
+				else return false;
+				
+			case Op::Not:
+				if constexpr (contains_type<bool,VM_TYPES...>()) {
+					stack<bool>().push(not getpop<bool>());
+					return true;
+				}
+				else return false;
+				
+			case Op::Implies:
+				if constexpr (contains_type<bool,VM_TYPES...>()) {
+					bool x = getpop<bool>();
+					bool y = getpop<bool>();
+					stack<bool>().push((not x) or y);
+					return true;
+				}
+				else return false;
+				
+			case Op::Iff:
+				if constexpr (contains_type<bool,VM_TYPES...>()) {
+					bool x = getpop<bool>();
+					bool y = getpop<bool>();
+					stack<bool>().push(x == y);
+					return true;
+				}
+				else return false;
+			
+			// everything else goes through i.f (listed so that -Wswitch-enum tells us when Ops.h changes)
+			case Op::Recurse: case Op::SafeRecurse: case Op::MemRecurse: case Op::SafeMemRecurse:
+			case Op::LexiconRecurse: case Op::LexiconSafeRecurse: case Op::LexiconMemRecurse: case Op::LexiconSafeMemRecurse:
+			case Op::Flip: case Op::FlipP: case Op::SafeFlipP: case Op::Sample: case Op::Mem: case Op::selfptr:
+			case Op::CL_I: case Op::CL_S: case Op::CL_K: case Op::CL_Apply:
+			case Op::Custom1: case Op::Custom2: case Op::Custom3: case Op::Custom4: case Op::Custom5:
+			default:
+				return false;
+		}
+	}
+	
+	/**
+	 * @brief Run a single instruction
+	 * @param i
+	 */	
+	[[gnu::always_inline]] inline void execute(const Instruction& i) {
+		#ifndef NO_DIRECT_DISPATCH
+		if(dispatch_builtin(i)) return; 
+		#endif
+		
+		tail_call = i.tail;
+		auto f = reinterpret_cast<FT*>(i.f);
+		(*f)(const_cast<this_t*>(this), i.arg);
+	}
+	
+	/**
+	 * @brief This is called by the recursion builtins once they have popped their arguments. If the recursion is in
+	 * 		  tail position and we are already inside a recursive call (so the next thing to run is that call's PopX), 
+	 * 		  then the callee's answer is also our answer. So we can drop the rest of our frame, replace our x with 
+	 * 		  the new one, and let the existing PopX remove it -- the caller then pushes the program as usual, and deep
+	 * 		  tail recursions run with a constant size xstack and program stack. 
+	 * @param x - the argument to the recursion
+	 * @return true if we did this (and x was moved from); false means the caller has to push x and PopX itself
+	 */
+	bool tail_recurse(input_t& x) {
+		if(not (TAIL_CALLS and tail_call)) return false;
+		
+		program.end_frame(); // nothing is left in it except jumps to its end
+		if(program.empty() or program.top().op != Op::PopX) return false;
+		
+		xstack.topref() = std::move(x);
+		return true;
+	}
+	
 	/**
 	 * @brief Run 
 	 * @return 
@@ -243,24 +471,35 @@ public:
 			while(status == vmstatus_t::GOOD and (not program.empty()) ) {
 				
 				if(program.size() + runtime_counter.total > MAX_RUN_PROGRAM ) {  // if we've run too long or we couldn't possibly finish
-					throw VMSRuntimeError();
+					status = vmstatus_t::ERROR;
+					break;
 				}
 				
 				vm_ops++;
 				
-				Instruction i = program.top(); program.pop();
+				Instruction i = program.next();
 //				print("Instruction", i);
 				
 				// keep track of what instruction we've run
 				runtime_counter.increment(i);
+				#ifdef RUNTIME_COUNT_RULES
+				auto& profile = RuntimeCounter::profile();
+				profile.increment(i);
+				#endif
 				
-				auto f = reinterpret_cast<FT*>(i.f);
-				(*f)(const_cast<this_t*>(this), i.arg);
+				#ifdef RUNTIME_TIME_RULES
+				const auto start = RuntimeCounter::cycles();
+				execute(i);
+				profile.add_cycles(i, RuntimeCounter::cycles()-start);
+				#else
+				execute(i);
+				#endif
 				 
 			} // end while loop over ops
 			
 		} catch (VMSRuntimeError& e) {
-			// this may be thrown by a primitive
+			// this may be thrown by a primitive (though it is faster for them to set status to ERROR, or 
+			// for functions given to Grammar::add to return an empty std::optional)
 			status = vmstatus_t::ERROR;
 		}
 		
@@ -275,7 +514,7 @@ public:
 		}
 		else {
 			// if we get here, there was a problem 
-			return err;
+			return *err;
 		}
 	}	
 	